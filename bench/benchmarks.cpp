@@ -0,0 +1,618 @@
+// Benchmarks of the hot paths of the library. Every result is a single line of JSON on the standard output:
+//	{"benchmark":"launch_sync","params":{},"ops":1000000,"seconds":0.0412,"ns_per_op":41.2,"ops_per_sec":24271844}
+// so runs can be kept and compared (e.g. with jq). Usage: benchmarks [name filter] [max suspended coroutines]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "channel.h"
+#include "filering.h"
+#include "generator.h"
+#include "reactor.h"
+#include "taskcoroutines.h"
+
+using namespace aw_coroutines;
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+typedef std::vector<std::shared_ptr<Task<int>>> Tasks;
+
+char const* nameFilter = nullptr;
+size_t maxSuspended = 1000000;
+volatile int sink; // so the compiler doesn't throw the measured work away
+
+bool selected(char const* name) {
+	return !nameFilter || std::strstr(name, nameFilter);
+}
+
+double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+long residentKB() { // the second field of the statm is the resident set in pages
+	long size = 0, resident = 0;
+	if (FILE* pFile = std::fopen("/proc/self/statm", "r")) {
+		if (std::fscanf(pFile, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		std::fclose(pFile);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void report(char const* name, std::string const& params, size_t ops, double seconds, std::string const& extra = "") { // the extra fields of the benchmark, already in JSON
+	std::printf("{\"benchmark\":\"%s\",\"params\":{%s},\"ops\":%zu,\"seconds\":%.6f,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f", name, params.c_str(), ops, seconds, seconds * 1e9 / ops, ops / seconds);
+	if (!extra.empty())
+		std::printf(",%s", extra.c_str());
+	std::printf("}\n");
+	std::fflush(stdout);
+}
+
+std::string param(char const* name, long value) {
+	return "\"" + std::string(name) + "\":" + std::to_string(value);
+}
+
+std::string param(char const* name, char const* value) {
+	return "\"" + std::string(name) + "\":\"" + value + "\"";
+}
+
+Tasks pendingTasks(size_t count, Executor* pExecutor) {
+	Tasks tasks(count);
+	for (auto& spTask : tasks) {
+		spTask = std::make_shared<Task<int>>();
+		spTask->setExecutor(pExecutor);
+	}
+	return tasks;
+}
+
+void waitAll(Tasks& tasks) {
+	for (auto& spTask : tasks)
+		spTask->wait();
+}
+
+// ROUTINES
+Tasks* pAwaited = nullptr; // what the routines below await
+std::shared_ptr<Task<int>> spCompleted;
+std::atomic<size_t> awaitsDone{0};
+
+int syncRoutine(Caller<int, int>, int x) {
+	return x + 1;
+}
+
+int awaitOneRoutine(Caller<int, int> caller, int index) { // suspends once on its own task
+	return caller.await(*(*pAwaited)[index]) + 1;
+}
+
+int awaitSharedRoutine(Caller<int, int> caller, int) { // suspends once on the task every one of them awaits
+	return caller.await(*(*pAwaited)[0]) + 1;
+}
+
+int awaitCompletedRoutine(Caller<int, int> caller, int count) {
+	int sum = 0;
+	for (int i = 0; i < count; ++i)
+		sum += caller.await(*spCompleted);
+	return sum;
+}
+
+int awaitEachRoutine(Caller<int, int> caller, int count) { // suspends on every task in turn
+	int sum = 0;
+	for (int i = 0; i < count; ++i) {
+		sum += caller.await(*(*pAwaited)[i]);
+		awaitsDone.store(i + 1, std::memory_order_release);
+	}
+	return sum;
+}
+
+struct Connection {
+	Reactor* pReactor;
+	int fd;
+	std::vector<uint64_t>* pLatencies; // of the client's requests, in nanoseconds
+};
+
+void setNoDelay(int fd) {
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int echoRoutine(Caller<Connection, int> caller, Connection connection) { // the server's side of a connection
+	char buffer[256];
+	try {
+		while (size_t count = caller.await(connection.pReactor->readAsync(connection.fd, buffer, sizeof(buffer))))
+			caller.await(connection.pReactor->writeAsync(connection.fd, buffer, count));
+	} catch (std::system_error const&) {} // cancelled by the reactor going away
+	connection.pReactor->remove(connection.fd);
+	close(connection.fd);
+	return 0;
+}
+
+int acceptRoutine(Caller<Connection, int> caller, Connection listener) {
+	Caller<Connection, int> echo(&echoRoutine, 65536);
+	try {
+		while (true) {
+			int fd = caller.await(listener.pReactor->acceptAsync(listener.fd));
+			setNoDelay(fd);
+			listener.pReactor->add(fd);
+			echo(Connection{listener.pReactor, fd, nullptr});
+		}
+	} catch (std::system_error const&) {} // the listener has been removed
+	return 0;
+}
+
+int clientRoutine(Caller<Connection, int> caller, Connection connection) { // a request and its echo at a time
+	char request[64] = {};
+	char response[sizeof(request)];
+	for (uint64_t& rLatency : *connection.pLatencies) {
+		Clock::time_point start = Clock::now();
+		caller.await(connection.pReactor->writeAsync(connection.fd, request, sizeof(request)));
+		for (size_t received = 0; received < sizeof(response); ) {
+			size_t count = caller.await(connection.pReactor->readAsync(connection.fd, response + received, sizeof(response) - received));
+			if (!count)
+				throw std::runtime_error("The echo server has closed the connection.");
+			received += count;
+		}
+		rLatency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	}
+	return 0;
+}
+
+struct FileReads {
+	FileRing* pRing;
+	int fd;
+	size_t count;
+	size_t blocks; // in the file
+};
+
+int fileReadRoutine(Caller<FileReads, int> caller, FileReads reads) { // one read at a time, at pseudo-random offsets
+	alignas(4096) char buffer[4096];
+	uint64_t block = reinterpret_cast<uintptr_t>(&reads) * 2654435761u;
+	for (size_t i = 0; i < reads.count; ++i) {
+		block = block * 6364136223846793005u + 1442695040888963407u;
+		caller.await(reads.pRing->readFileAsync(reads.fd, buffer, sizeof(buffer), (block >> 33) % reads.blocks * sizeof(buffer)));
+	}
+	return 0;
+}
+
+struct NoopTimer: Timer {
+	NoopTimer() : Timer(&fired) {}
+	static void fired(Timer&, bool) {}
+};
+
+int sleepRoutine(Caller<int, int> caller, int) { // how late the sleep ends
+	Clock::time_point due = Clock::now() + std::chrono::milliseconds(10);
+	caller.await(TimerWheel::defaultWheel().sleepAsync(std::chrono::milliseconds(10)));
+	return static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - due).count());
+}
+
+struct NoopCallback: CancellationCallback {
+	NoopCallback() : CancellationCallback(&cancelled) {}
+	static void cancelled(CancellationCallback&) {}
+};
+
+int cancelledRoutine(Caller<CancellationToken, int> caller, CancellationToken token) { // suspends on a task that's never resolved until the token is cancelled
+	std::shared_ptr<Task<int>> spNever = std::make_shared<Task<int>>();
+	try {
+		return caller.await(spNever, token);
+	} catch (std::system_error&) {
+		return 0;
+	}
+}
+
+void countTo(Yield<size_t>& yield, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		yield(i);
+}
+
+void countAwaitingTo(AsyncYield<size_t>& yield, size_t count) { // awaits a task before every value, a completed one (a row already buffered)
+	std::shared_ptr<Task<size_t>> spBuffered = std::make_shared<Task<size_t>>();
+	spBuffered->setResult(1);
+	for (size_t i = 0; i < count; ++i)
+		yield(i + yield.await(*spBuffered) - 1);
+}
+
+int generatorRoutine(Caller<size_t, int> caller, size_t count) { // pulls an async generator to its end
+	AsyncGenerator<size_t, size_t> numbers(&countAwaitingTo, count);
+	size_t sum = 0;
+	while (size_t const* pNumber = caller.await(numbers))
+		sum += *pNumber;
+	return static_cast<int>(sum);
+}
+
+int sendRoutine(Caller<std::pair<Channel<size_t>*, size_t>, int> caller, std::pair<Channel<size_t>*, size_t> input) {
+	for (size_t i = 0; i < input.second; ++i)
+		caller.await(input.first->sendAsync(i));
+	input.first->close();
+	return 0;
+}
+
+int receiveRoutine(Caller<Channel<size_t>*, int> caller, Channel<size_t>* pChannel) {
+	size_t value;
+	size_t received = 0;
+	while (caller.await(pChannel->receiveAsync(value)))
+		++received;
+	return static_cast<int>(received);
+}
+
+// BENCHMARKS
+void launchSync() {
+	Caller<int, int> caller(&syncRoutine, StackPool::minStackSize);
+	for (int i = 0; i < 10000; ++i) // warms up the stack pool and the frame allocator
+		caller(i);
+	size_t const count = 1000000;
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; ++i)
+		sink = caller(static_cast<int>(i))->getResult();
+	report("launch_sync", "", count, secondsSince(start));
+}
+
+void launchSuspend() {
+	size_t const count = 10000; // every one holds a stack until it's resumed
+	Tasks awaited = pendingTasks(count, nullptr);
+	pAwaited = &awaited;
+	Tasks results(count);
+	Caller<int, int> caller(&awaitOneRoutine, StackPool::minStackSize);
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; ++i)
+		results[i] = caller(static_cast<int>(i));
+	report("launch_suspend", "", count, secondsSince(start));
+
+	start = Clock::now();
+	for (size_t i = 0; i < count; ++i)
+		awaited[i]->setResult(static_cast<int>(i)); // resumed right away on this thread
+	report("resume_inline", "", count, secondsSince(start));
+	waitAll(results);
+}
+
+void awaitCompleted() {
+	spCompleted = std::make_shared<Task<int>>();
+	spCompleted->setResult(1);
+	int const count = 10000000;
+	Caller<int, int> caller(&awaitCompletedRoutine, StackPool::minStackSize);
+	Clock::time_point start = Clock::now();
+	sink = caller(count)->getResult();
+	report("await_completed", "", count, secondsSince(start));
+}
+
+void awaitPending() { // a full round trip: the coroutine switches out in the await() and the setResult() switches back into it
+	for (Executor* pExecutor : {static_cast<Executor*>(nullptr), &Executor::defaultExecutor()}) {
+		size_t const count = pExecutor ? 100000 : 1000000;
+		Tasks awaited = pendingTasks(count, pExecutor);
+		pAwaited = &awaited;
+		awaitsDone.store(0);
+		Caller<int, int> caller(&awaitEachRoutine, StackPool::minStackSize);
+		std::shared_ptr<Task<int>> spResult = caller(static_cast<int>(count));
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < count; ++i) {
+			awaited[i]->setResult(1);
+			while (awaitsDone.load(std::memory_order_acquire) <= i) // the worker has to get to the next await() first, otherwise it would find the task completed
+				std::this_thread::yield();
+		}
+		spResult->wait();
+		report("await_pending", param("executor", pExecutor ? "default" : "inline"), count, secondsSince(start));
+	}
+}
+
+void continueWithChain() {
+	size_t const length = 1000;
+	size_t const rounds = 1000;
+	double buildSeconds = 0, resolveSeconds = 0;
+	for (size_t round = 0; round < rounds; ++round) {
+		auto spHead = std::make_shared<Task<int>>();
+		std::shared_ptr<Task<int>> spTail = spHead;
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < length; ++i)
+			spTail = spTail->continueWith([](Task<int>& prev) { return prev.getResult() + 1; });
+		buildSeconds += secondsSince(start);
+		start = Clock::now();
+		spHead->setResult(0);
+		sink = spTail->getResult();
+		resolveSeconds += secondsSince(start);
+	}
+	report("continuewith_build", param("length", length), length * rounds, buildSeconds);
+	report("continuewith_resolve", param("length", length), length * rounds, resolveSeconds);
+}
+
+void handoff() { // setResult() on one thread, wait() on the other, and back
+	size_t const count = 100000;
+	Tasks requests = pendingTasks(count, nullptr);
+	Tasks responses = pendingTasks(count, nullptr);
+	std::thread responder([&]{
+		for (size_t i = 0; i < count; ++i) {
+			requests[i]->wait();
+			responses[i]->setResult(requests[i]->getResult());
+		}
+	});
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		requests[i]->setResult(static_cast<int>(i));
+		responses[i]->wait();
+	}
+	report("handoff_roundtrip", "", count, secondsSince(start));
+	responder.join();
+}
+
+void resolverScaling() { // coroutines suspended on their own tasks, resolved by several threads at once and resumed on the default executor
+	size_t const count = 20000;
+	size_t maxThreads = std::max(4u, std::thread::hardware_concurrency());
+	for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+		Tasks awaited = pendingTasks(count, &Executor::defaultExecutor());
+		pAwaited = &awaited;
+		Tasks results(count);
+		Caller<int, int> caller(&awaitOneRoutine, StackPool::minStackSize);
+		for (size_t i = 0; i < count; ++i)
+			results[i] = caller(static_cast<int>(i));
+
+		Clock::time_point start = Clock::now();
+		std::vector<std::thread> resolvers;
+		for (size_t t = 0; t < threads; ++t)
+			resolvers.emplace_back([&, t]{
+				for (size_t i = t; i < count; i += threads)
+					awaited[i]->setResult(static_cast<int>(i));
+			});
+		for (auto& resolver : resolvers)
+			resolver.join();
+		waitAll(results);
+		report("resolver_scaling", param("threads", threads) + "," + param("workers", Executor::defaultExecutor().workers()), count, secondsSince(start));
+	}
+}
+
+void echo() { // requests of 64 bytes over loopback TCP connections: the clients and the server are coroutines on the same reactor, resumed right on its loops
+	size_t const totalRequests = 200000;
+	for (size_t loops : {1, 2})
+		for (size_t connections : {1, 16, 64}) {
+			Reactor reactor(loops, nullptr);
+			int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			sockaddr_in address{};
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t length = sizeof(address);
+			if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), length) || listen(listener, 1024) || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length)) {
+				std::perror("echo");
+				return;
+			}
+			reactor.add(listener);
+			Caller<Connection, int> acceptor(&acceptRoutine, 65536);
+			std::shared_ptr<Task<int>> spAcceptor = acceptor(Connection{&reactor, listener, nullptr});
+
+			std::vector<std::vector<uint64_t>> latencies(connections, std::vector<uint64_t>(totalRequests / connections));
+			std::vector<int> clients(connections);
+			for (int& fd : clients) {
+				fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				setNoDelay(fd);
+				reactor.add(fd);
+				reactor.connectAsync(fd, reinterpret_cast<sockaddr*>(&address), length)->wait();
+			}
+
+			Tasks results(connections);
+			Caller<Connection, int> client(&clientRoutine, 65536);
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < connections; ++i)
+				results[i] = client(Connection{&reactor, clients[i], &latencies[i]});
+			waitAll(results);
+			double seconds = secondsSince(start);
+
+			for (int fd : clients) { // the servers' coroutines see the end of their streams
+				reactor.remove(fd);
+				close(fd);
+			}
+			reactor.remove(listener);
+			close(listener);
+			spAcceptor->wait();
+
+			std::vector<uint64_t> all;
+			for (auto& clientLatencies : latencies)
+				all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+			std::sort(all.begin(), all.end());
+			report("echo", param("loops", loops) + "," + param("connections", connections), all.size(), seconds, param("p50_ns", all[all.size() / 2]) + "," + param("p99_ns", all[all.size() * 99 / 100]));
+		}
+}
+
+void fileReads() { // 4KB reads of a file in the page cache: the blocking pread() on one thread against the coroutines keeping the FileRing's queue full
+	size_t const blocks = 16384;
+	size_t const totalReads = 200000;
+	char path[] = "/tmp/aw_benchmarksXXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		std::perror("file_read");
+		return;
+	}
+	unlink(path);
+	std::vector<char> block(4096, 'x');
+	for (size_t i = 0; i < blocks; ++i)
+		if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size())) {
+			std::perror("file_read");
+			close(fd);
+			return;
+		}
+
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < totalReads; ++i)
+		sink = pread(fd, block.data(), block.size(), (i * 7919) % blocks * block.size());
+	report("file_read", param("mode", "pread"), totalReads, secondsSince(start));
+
+	for (size_t depth : {1, 16, 64}) {
+		FileRing ring(256, nullptr);
+		Caller<FileReads, int> reader(&fileReadRoutine, 65536);
+		Tasks results(depth);
+		start = Clock::now();
+		for (auto& spResult : results)
+			spResult = reader(FileReads{&ring, fd, totalReads / depth, blocks});
+		waitAll(results);
+		report("file_read", param("mode", ring.usesUring() ? "io_uring" : "fallback") + "," + param("queue_depth", depth), totalReads / depth * depth, secondsSince(start));
+	}
+	close(fd);
+}
+
+void timers() { // scheduling and cancelling with a million timers pending (spread over ~17 minutes, so all the levels are in use), then coroutines sleeping at once
+	size_t const pending = 1000000;
+	size_t const count = 1000000;
+	TimerWheel wheel;
+	std::vector<NoopTimer> background(pending);
+	std::vector<NoopTimer> measured(count);
+	Clock::time_point now = Clock::now();
+	for (size_t i = 0; i < pending; ++i)
+		wheel.schedule(background[i], now + std::chrono::milliseconds(1000 + i));
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < count; ++i)
+		wheel.schedule(measured[i], now + std::chrono::milliseconds(1000 + (i * 7919) % pending));
+	report("timer_schedule", param("pending", pending), count, secondsSince(start));
+	start = Clock::now();
+	for (size_t i = 0; i < count; ++i)
+		wheel.cancel(measured[i]);
+	report("timer_cancel", param("pending", pending + count), count, secondsSince(start));
+	for (auto& rTimer : background)
+		wheel.cancel(rTimer);
+
+	size_t const sleepers = 10000;
+	Caller<int, int> caller(&sleepRoutine);
+	Tasks results(sleepers);
+	start = Clock::now();
+	for (auto& spResult : results)
+		spResult = caller(0);
+	waitAll(results);
+	double seconds = secondsSince(start);
+	std::vector<long> lateness;
+	for (auto& spResult : results)
+		lateness.push_back(spResult->getResult());
+	std::sort(lateness.begin(), lateness.end());
+	report("sleep_async", param("sleeping", sleepers) + "," + param("ms", 10), sleepers, seconds, param("late_p50_us", lateness[sleepers / 2]) + "," + param("late_p99_us", lateness[sleepers * 99 / 100]));
+}
+
+void cancellation() { // registering and unregistering callbacks with a token, then cancelling coroutines suspended on tasks never resolved
+	size_t const count = 1000000;
+	CancellationSource source;
+	CancellationToken token = source.token();
+	std::vector<NoopCallback> callbacks(count);
+	Clock::time_point start = Clock::now();
+	for (auto& rCallback : callbacks)
+		token.subscribe(rCallback);
+	for (auto& rCallback : callbacks)
+		token.unsubscribe(rCallback);
+	report("cancel_subscribe", param("callbacks", count), count, secondsSince(start));
+
+	size_t const suspended = 10000;
+	Caller<CancellationToken, int> caller(&cancelledRoutine);
+	Tasks results(suspended);
+	for (auto& spResult : results)
+		spResult = caller(token);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100)); // all of them suspended
+	start = Clock::now();
+	source.cancel();
+	waitAll(results);
+	report("cancel_await", param("suspended", suspended), suspended, secondsSince(start));
+}
+
+void generators() { // a value pulled from a generator: a switch into its routine and back
+	size_t const count = 10000000;
+	Generator<size_t, size_t> numbers(&countTo, count, StackPool::minStackSize);
+	size_t sum = 0;
+	Clock::time_point start = Clock::now();
+	for (size_t number : numbers)
+		sum += number;
+	report("generator_next", param("values", count), count, secondsSince(start));
+	(void)sum; // the switches can't be optimized away anyway
+
+	Caller<size_t, int> caller(&generatorRoutine, StackPool::minStackSize);
+	start = Clock::now();
+	std::shared_ptr<Task<int>> spResult = caller(count);
+	spResult->wait();
+	report("generator_await", param("values", count), count, secondsSince(start));
+}
+
+void channels() { // a value through the ring without waiting, then a producer and a consumer coroutine passing values through channels of several sizes
+	size_t const count = 1000000;
+	{
+		Channel<size_t> channel(64);
+		size_t value;
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < count; ++i) {
+			channel.trySend(std::move(i));
+			channel.tryReceive(value);
+		}
+		report("channel_try", param("capacity", channel.capacity()), count, secondsSince(start));
+	}
+	for (Executor* pExecutor : {&Executor::defaultExecutor(), static_cast<Executor*>(nullptr)})
+		for (size_t capacity : {2, 64, 1024}) {
+			Channel<size_t> channel(capacity, pExecutor);
+			Caller<std::pair<Channel<size_t>*, size_t>, int> sender(&sendRoutine, StackPool::minStackSize);
+			Caller<Channel<size_t>*, int> receiver(&receiveRoutine, StackPool::minStackSize);
+			Clock::time_point start = Clock::now();
+			std::shared_ptr<Task<int>> spReceived = receiver(&channel);
+			std::shared_ptr<Task<int>> spSent = sender(std::make_pair(&channel, count));
+			spSent->wait();
+			spReceived->wait();
+			report("channel_pipeline", param("capacity", capacity) + "," + param("executor", pExecutor ? "default" : "inline"), count, secondsSince(start));
+		}
+}
+
+void suspendedScaling() { // many coroutines suspended at once: the memory they hold and the time to launch and resume them
+	struct Mode {
+		char const* name;
+		size_t stackSize;
+		size_t maxCount;
+	};
+	Mode const modes[] = {{"own", StackPool::minStackSize, 10000}, {"shared", StackPool::sharedStack, maxSuspended}}; // every own stack is two mappings, the limit on them (vm.max_map_count) is usually 65530
+	for (Mode const& mode : modes)
+		for (size_t count = 1000; count <= mode.maxCount; count *= 10) {
+			Tasks awaited = pendingTasks(1, &Executor::defaultExecutor());
+			pAwaited = &awaited;
+			Tasks results(count);
+			Caller<int, int> caller(&awaitSharedRoutine, mode.stackSize);
+			long rssBefore = residentKB();
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < count; ++i)
+				results[i] = caller(0);
+			double launchSeconds = secondsSince(start);
+			long rssDelta = residentKB() - rssBefore;
+			std::string params = param("stacks", mode.name) + "," + param("suspended", count);
+			report("suspended_launch", params, count, launchSeconds, param("rss_kb", rssDelta));
+
+			start = Clock::now();
+			awaited[0]->setResult(0);
+			waitAll(results);
+			report("suspended_resume", params, count, secondsSince(start));
+		}
+}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 1 && *argv[1])
+		nameFilter = argv[1];
+	if (argc > 2)
+		maxSuspended = std::strtoul(argv[2], nullptr, 10);
+
+	struct Benchmark {
+		char const* name;
+		void (*run)();
+	};
+	Benchmark const benchmarks[] = {
+		{"launch_sync", &launchSync},
+		{"launch_suspend", &launchSuspend},
+		{"await_completed", &awaitCompleted},
+		{"await_pending", &awaitPending},
+		{"continuewith", &continueWithChain},
+		{"handoff", &handoff},
+		{"resolver_scaling", &resolverScaling},
+		{"echo", &echo},
+		{"file_read", &fileReads},
+		{"timer", &timers},
+		{"cancel", &cancellation},
+		{"generator", &generators},
+		{"channel", &channels},
+		{"suspended", &suspendedScaling}
+	};
+	for (Benchmark const& benchmark : benchmarks)
+		if (selected(benchmark.name))
+			benchmark.run();
+	return 0;
+}
@@ -3,8 +3,6 @@
 
 #include <memory>
 #include <string>
-#include <vector>
-#include <thread>
 #include "taskcoroutines.h"
 
 using namespace aw_coroutines;
@@ -19,8 +17,7 @@ public:
 	DataBase& operator=(const DataBase&) = delete;
 	DataBase(DataBase&&) = default;
 	DataBase& operator=(DataBase&&) = default;
-	std::shared_ptr<Task<std::string>> queryAsync(std::string address, std::string query);
-	std::vector<std::thread> threads;
+	std::shared_ptr<Task<std::string>> queryAsync(std::string address, std::string query, CancellationToken const& token = CancellationToken()); // a cancelled query ends with a std::system_error (std::errc::operation_canceled)
 private:
 	CompletionPort* completionPort;
 };
@@ -4,13 +4,18 @@
 #include <chrono>
 #include <memory>
 #include <vector>
-#include <queue>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <cstdint>
+#include <stdexcept>
+#include <system_error>
 #include "completion_port.h"
 
 namespace aw_completionPort {
 
 class CompletionPort;
-bool getQueuedCompletionStatus(CompletionPort *cp, void **completionKey);
+bool getQueuedCompletionStatusEx(CompletionPort *cp, void **completionKeys, size_t count, size_t *removed);
 
 class TaskResolverBase {
 public:
@@ -18,39 +23,152 @@ public:
 	virtual void resolve() = 0;
 };
 
+// Dmitry Vyukov's bounded MPMC queue: every cell has a sequence number telling whether it's free for the producer of the given position or full for the consumer of it, so both sides claim their positions with a single CAS and never wait on each other
+template <class T>
+class MpmcQueue {
+public:
+	explicit MpmcQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1) { // the capacity is a power of 2
+		for (size_t i = 0; i < capacity; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	bool push(T const& value) { // false if it's full
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &cells[pos & mask];
+			intptr_t diff = static_cast<intptr_t>(cell->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+			if (!diff) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0)
+				return false;
+			else
+				pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	size_t popBatch(T* values, size_t count) { // takes up to the count of values ready in a row with a single CAS, 0 if it's empty
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		size_t ready;
+		while (true) {
+			for (ready = 0; ready < count && cells[(pos + ready) & mask].sequence.load(std::memory_order_acquire) == pos + ready + 1; ++ready);
+			if (!ready) {
+				if (static_cast<intptr_t>(cells[pos & mask].sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1) < 0)
+					return 0; // empty (or the producer of the first cell hasn't finished yet)
+				pos = dequeuePos.load(std::memory_order_relaxed); // somebody else has taken it
+				continue;
+			}
+			if (dequeuePos.compare_exchange_weak(pos, pos + ready, std::memory_order_relaxed))
+				break;
+		}
+		for (size_t i = 0; i < ready; ++i) {
+			Cell& cell = cells[(pos + i) & mask];
+			values[i] = cell.value;
+			cell.sequence.store(pos + i + mask + 1, std::memory_order_release); // free for the producer one lap later
+		}
+		return ready;
+	}
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+	std::unique_ptr<Cell[]> cells;
+	size_t const mask;
+	char padding0[64]; // the producers and the consumers on separate cache lines (not alignas, the port is created with a plain new in C++14)
+	std::atomic<size_t> enqueuePos{0};
+	char padding1[64];
+	std::atomic<size_t> dequeuePos{0};
+};
+
+// socket -> completion key, growing in chunks as the sockets are associated; the lookups take no lock
+class KeyTable {
+public:
+	~KeyTable() {
+		for (auto& chunk : chunks)
+			delete[] chunk.load(std::memory_order_relaxed);
+	}
+	void set(int socket, void* key) {
+		std::atomic<void*>* chunk = chunks[socket / chunkSize].load(std::memory_order_acquire);
+		if (!chunk) {
+			std::unique_lock<std::mutex> lk(mutex);
+			chunk = chunks[socket / chunkSize].load(std::memory_order_relaxed);
+			if (!chunk) {
+				chunk = new std::atomic<void*>[chunkSize]();
+				chunks[socket / chunkSize].store(chunk, std::memory_order_release);
+			}
+		}
+		chunk[socket % chunkSize].store(key, std::memory_order_release);
+	}
+	void* get(int socket) const {
+		std::atomic<void*>* chunk = chunks[socket / chunkSize].load(std::memory_order_acquire);
+		return chunk ? chunk[socket % chunkSize].load(std::memory_order_acquire) : nullptr;
+	}
+	static constexpr size_t chunkSize = 256;
+	static constexpr size_t maxChunks = 4096;
+private:
+	std::mutex mutex; // only for adding chunks
+	std::atomic<std::atomic<void*>*> chunks[maxChunks] = {};
+};
+
+// Like the Windows one: any number of worker threads wait on the port, but no more than the concurrency value of them are let run at once (a worker counts as running from the moment it takes completions until it comes back for more)
 class CompletionPort {
 public:
+	CompletionPort(unsigned concurrency) : concurrency(concurrency ? concurrency : std::max(1u, std::thread::hardware_concurrency())) {
+		for (unsigned i = 0; i < 2 * this->concurrency; ++i) // twice as many as may run, so there's always one to take over from a worker held up in its continuation
+			threads.emplace_back(&CompletionPort::completionPortAppWorkerThread, this);
+	}
 	~CompletionPort() {
-		std::unique_lock<std::mutex> lk(mutex);
-		goHome = true;
-		lk.unlock();
-		cv.notify_one();
-		thread.join();
+		{
+			std::unique_lock<std::mutex> lk(mutex);
+			goHome = true;
+		}
+		cv.notify_all();
+		for (auto& thread : threads)
+			thread.join();
 	}
-	std::mutex mutex;
+	static constexpr size_t maxBatch = 16; // completions a worker takes at once
+
+	MpmcQueue<int> socketsPending{4096};
+	std::atomic<size_t> queued{0}; // in the socketsPending
+	std::atomic<unsigned> running{0};
+	std::atomic<unsigned> sleeping{0};
+	unsigned const concurrency;
+	std::mutex mutex; // only for sleeping
 	std::condition_variable cv;
-	std::queue<int> socketsPending;
 	bool goHome = false;
-	void* completionKeys[20] = {nullptr};
-	std::thread thread = {std::thread(&CompletionPort::completionPortAppWorkerThread, this)};
+	KeyTable completionKeys;
+	std::vector<std::thread> threads;
 
-	void completionPortAppWorkerThread() {
-		void *completionKey = nullptr;
-		while (true) {
-			if(!getQueuedCompletionStatus(this, &completionKey))
-				break;
-			TaskResolverBase* pResolver = static_cast<TaskResolverBase*>(completionKey);
-			pResolver->resolve();
-			delete pResolver;
+	void wakeOne() {
+		if (sleeping.load()) { // sequentially consistent with the worker's check of the queued and the running (as in the Executor::post())
+			std::unique_lock<std::mutex> lk(mutex);
+			lk.unlock();
+			cv.notify_one();
 		}
 	}
+
+	void completionPortAppWorkerThread() {
+		void* completionKeys[maxBatch];
+		size_t removed = 0;
+		while (getQueuedCompletionStatusEx(this, completionKeys, maxBatch, &removed))
+			for (size_t i = 0; i < removed; ++i) { // resolved right here, the coroutines are resumed on their tasks' executor
+				TaskResolverBase* pResolver = static_cast<TaskResolverBase*>(completionKeys[i]);
+				pResolver->resolve();
+				delete pResolver;
+			}
+	}
 };
 
+thread_local CompletionPort* runningOn = nullptr; // the port the calling worker counts as running on
+
 void kernelWakeThreadFor(CompletionPort *cp, int socket) {
-	std::unique_lock<std::mutex> lk(cp->mutex);
-	cp->socketsPending.push(socket);
-	lk.unlock();
-	cp->cv.notify_one();
+	while (!cp->socketsPending.push(socket)) // full, the workers are behind
+		std::this_thread::yield();
+	cp->queued.fetch_add(1);
+	cp->wakeOne();
 }
 
 static class Kernel {
@@ -58,11 +176,14 @@ public:
 	Kernel() : kernelFileTable(100) {}
 
 	~Kernel() {
-		for (auto & t : threads)
-			t.join();
+		for (auto& read : reads)
+			read->wait();
 	}
 
 	int socket() {
+		std::unique_lock<std::mutex> lk(mutex);
+		if (static_cast<size_t>(socketNumber + 1) >= kernelFileTable.size())
+			kernelFileTable.resize(2 * kernelFileTable.size());
 		return ++socketNumber;
 	}
 	void connect(int socket, std::string address) {
@@ -73,43 +194,68 @@ public:
 	}
 	std::string read(int socket) {
 		std::unique_lock<std::mutex> lk(mutex);
-		return kernelFileTable[socket].second;
+		return kernelFileTable[socket].buffer;
 	}
-	void readAsync(int socket) {
-		threads.emplace_back(&Kernel::kernel_read, this, socket);
+	bool aborted(int socket) {
+		std::unique_lock<std::mutex> lk(mutex);
+		return kernelFileTable[socket].aborted;
+	}
+	void readAsync(int socket, CancellationToken const& token) { // like the CancelIoEx(): a cancelled read is completed right away, as aborted
+		std::shared_ptr<Task<bool>> read = TimerWheel::defaultWheel().sleepAsync(std::chrono::milliseconds(2000), token)->continueWith([this, socket](Task<bool>& sleep) { // on the wheel's thread (or the cancelling one), no sleeper thread per read
+			if (sleep.getResult())
+				kernel_read(socket);
+			else
+				kernel_abort(socket);
+			return true;
+		});
+		std::unique_lock<std::mutex> lk(mutex);
+		reads.push_back(std::move(read));
 	}
 	void fillSocketBuffer(int socket, std::string value) {
 		std::unique_lock<std::mutex> lk(mutex);
-		kernelFileTable[socket].second = value;
+		kernelFileTable[socket].buffer = value;
 	}
 	void addSocketToCompletionPort(int socket, CompletionPort* cp) {
 		std::unique_lock<std::mutex> lk(mutex);
-		kernelFileTable[socket].first = cp;
+		kernelFileTable[socket].port = cp;
 	}
-	std::pair<CompletionPort*, std::string> readFileTable(int socket) {
+	CompletionPort* portOf(int socket) {
 		std::unique_lock<std::mutex> lk(mutex);
-		return kernelFileTable[socket];
+		return kernelFileTable[socket].port;
 	}
 private:
+	struct File {
+		CompletionPort* port;
+		std::string buffer;
+		bool aborted;
+	};
 	void kernel_read(int socket) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(2000));
 		fillSocketBuffer(socket, responses[(socket-1)%5]); // some value received over network
-		kernelWakeThreadFor(readFileTable(socket).first, socket);
+		kernelWakeThreadFor(portOf(socket), socket);
+	}
+	void kernel_abort(int socket) {
+		{
+			std::unique_lock<std::mutex> lk(mutex);
+			kernelFileTable[socket].aborted = true;
+		}
+		kernelWakeThreadFor(portOf(socket), socket);
 	}
 	std::mutex mutex;
-	std::vector<std::thread> threads;
-	std::vector<std::pair<CompletionPort*, std::string>> kernelFileTable;
-	int socketNumber = 0;
+	std::vector<std::shared_ptr<Task<bool>>> reads;
+	std::vector<File> kernelFileTable;
+	int socketNumber = 0; // guarded by the mutex
 	std::string responses[5] = { "June", "Moone", "RESPONSE_3", "RESPONSE_4", "RESPONSE_5" };
 } kernel;
 
-CompletionPort* createIoCompletionPort(int fileHandle, CompletionPort *existingCompletionPort, void *completionKey) {
+CompletionPort* createIoCompletionPort(int fileHandle, CompletionPort *existingCompletionPort, void *completionKey, unsigned numberOfConcurrentThreads = 0) {
 	CompletionPort* result = nullptr;
 	if (existingCompletionPort) {
-		existingCompletionPort->completionKeys[fileHandle] = completionKey;
+		if (static_cast<size_t>(fileHandle) >= KeyTable::chunkSize * KeyTable::maxChunks)
+			throw std::out_of_range("Too many sockets for the completion port.");
+		existingCompletionPort->completionKeys.set(fileHandle, completionKey);
 		kernel.addSocketToCompletionPort(fileHandle, existingCompletionPort);
 	} else {
-		result = new CompletionPort();
+		result = new CompletionPort(numberOfConcurrentThreads); // 0 means one for every hardware thread
 	}
 	return result;
 }
@@ -118,23 +264,46 @@ void closeCompletionPort(CompletionPort* cp) {
 	delete cp;
 }
 
-bool getQueuedCompletionStatus(CompletionPort *cp, void **completionKey) {
-	std::unique_lock<std::mutex> lk(cp->mutex);
-
-	if (cp->socketsPending.empty() && !cp->goHome)
-		cp->cv.wait(lk, [cp]{return !cp->socketsPending.empty() || cp->goHome;}); // releases the lock and reacquires it upon return
-	if (cp->goHome)
-		return false;
-	*completionKey = cp->completionKeys[cp->socketsPending.front()];
-	cp->socketsPending.pop();
-	return true;
+bool tryToRun(CompletionPort* cp) { // takes one of the concurrency slots
+	unsigned running = cp->running.load();
+	while (running < cp->concurrency)
+		if (cp->running.compare_exchange_weak(running, running + 1))
+			return true;
+	return false;
 }
 
-void dbTaskResolvingThread(std::shared_ptr<Task<std::string>> task, std::string result) {
-	try {
-		task->setResult(result);
-	} catch(std::exception& ex) {
-		std::cout << "Logging caught exception: " << ex.what() << std::endl; // print nested XXX
+// takes up to the count of completions (their keys) at once, false once the port is being closed. The calling worker stops counting as running until it gets some
+bool getQueuedCompletionStatusEx(CompletionPort *cp, void **completionKeys, size_t count, size_t *removed) {
+	if (runningOn == cp) {
+		runningOn = nullptr;
+		cp->running.fetch_sub(1);
+		if (cp->queued.load())
+			cp->wakeOne(); // a sleeping worker may have been held back by the limit
+	}
+	int sockets[CompletionPort::maxBatch];
+	if (count > CompletionPort::maxBatch)
+		count = CompletionPort::maxBatch;
+	while (true) {
+		if (cp->queued.load() && tryToRun(cp)) {
+			size_t taken = cp->socketsPending.popBatch(sockets, count);
+			if (taken) {
+				cp->queued.fetch_sub(taken);
+				runningOn = cp;
+				for (size_t i = 0; i < taken; ++i)
+					completionKeys[i] = cp->completionKeys.get(sockets[i]);
+				*removed = taken;
+				if (taken == count && cp->queued.load())
+					cp->wakeOne(); // there's more than we can take, let another worker in (if the limit allows)
+				return true;
+			}
+			cp->running.fetch_sub(1); // somebody else got there first
+		}
+		std::unique_lock<std::mutex> lk(cp->mutex);
+		if (cp->goHome)
+			return false;
+		cp->sleeping.fetch_add(1);
+		cp->cv.wait(lk, [cp]{ return (cp->queued.load() && cp->running.load() < cp->concurrency) || cp->goHome; });
+		cp->sleeping.fetch_sub(1);
 	}
 }
 
@@ -142,8 +311,14 @@ class StringReadTaskResolver : public TaskResolverBase {
 public:
 	StringReadTaskResolver(DataBase* db, int socket, std::shared_ptr<Task<std::string>> spTask): mDataBase(db), mSocket(socket), mTask(spTask) {}
 	void resolve() override {
-		std::string result = kernel.read(mSocket);
-		mDataBase->threads.emplace_back(dbTaskResolvingThread, mTask, result);
+		try {
+			if (kernel.aborted(mSocket)) // like the ERROR_OPERATION_ABORTED
+				mTask->setException(std::system_error(std::make_error_code(std::errc::operation_canceled), "The query has been cancelled"));
+			else
+				mTask->setResult(kernel.read(mSocket)); // on the worker itself, the awaiting coroutine is only posted to its executor
+		} catch(std::exception& ex) {
+			std::cout << "Logging caught exception: " << ex.what() << std::endl;
+		}
 	}
 private:
 	DataBase* mDataBase;
@@ -154,19 +329,16 @@ private:
 DataBase::DataBase() : completionPort(createIoCompletionPort(0, nullptr, nullptr)) {}
 
 DataBase::~DataBase() {
-	for (auto& t : threads)
-		t.join();
-
 	closeCompletionPort(completionPort);
 }
 
-std::shared_ptr<Task<std::string>> DataBase::queryAsync(std::string address, std::string query) {
+std::shared_ptr<Task<std::string>> DataBase::queryAsync(std::string address, std::string query, CancellationToken const& token) {
 	int socket = kernel.socket();
 	kernel.connect(socket, address);
 	kernel.send(socket, query);
 	std::shared_ptr<Task<std::string>> spTask = std::make_shared<Task<std::string>>();
 	createIoCompletionPort(socket, completionPort, new StringReadTaskResolver(this, socket, spTask));
-	kernel.readAsync(socket);
+	kernel.readAsync(socket, token);
 	return spTask;
 }
 }
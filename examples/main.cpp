@@ -7,6 +7,9 @@
 #include <sys/syscall.h>
 #include <thread>
 #include <chrono>
+#ifdef AW_TRACING
+#include <fstream>
+#endif
 
 #ifdef SYS_gettid
 #define MY_GETTID syscall(SYS_gettid)
@@ -182,4 +185,15 @@ int main() {
 		}
 	}
 	PRINT_THREAD
+#ifdef AW_TRACING // make TRACE=1: open the file in chrome://tracing or ui.perfetto.dev
+	std::ofstream trace("sample.trace.json");
+	aw_coroutines::Tracer::exportChromeTrace(trace);
+	std::cout << "the trace has been written to sample.trace.json" << std::endl;
+#endif
+#ifdef AW_STATS // make STATS=1
+	aw_coroutines::StatsSnapshot stats = aw_coroutines::Stats::snapshot();
+	std::cout << "coroutines launched: " << stats.launched << ", live: " << stats.live << ", suspended: " << stats.suspended << std::endl;
+	std::cout << "awaits completed: " << stats.awaitsCompleted << ", suspended: " << stats.awaitsSuspended << ", p50 of the suspensions: " << stats.suspension.percentile(0.5) << "ns" << std::endl;
+	std::cout << "stacks mapped: " << stats.stacksMapped << " (" << stats.stackBytesMapped / 1024 << "KB), wait() calls that had to wait: " << stats.waits << ", p99 of them: " << stats.waitBlocking.percentile(0.99) << "ns" << std::endl;
+#endif
 }
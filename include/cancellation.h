@@ -0,0 +1,54 @@
+#ifndef AW_TASKCOROCANCELLATION_H
+#define AW_TASKCOROCANCELLATION_H
+
+#include <memory>
+#include "common.h"
+
+namespace aw_coroutines {
+template <class T>
+class Task;
+
+class CancellationCallback { // a node of the list of the callbacks registered with a token, a part of whoever registers it (like the Timer)
+public:
+	typedef void (*Function)(CancellationCallback&); // gets the derived object with a static_cast
+	explicit CancellationCallback(Function cancelled) : mCancelled(cancelled) {}
+	CancellationCallback(const CancellationCallback&) = delete;
+	CancellationCallback& operator=(const CancellationCallback&) = delete;
+private:
+	Function mCancelled; // called on the thread cancelling the source, once the callback is no longer registered
+	CancellationCallback* mNext = nullptr;
+	CancellationCallback** mLink = nullptr; // the pointer pointing at us, nullptr unless registered
+friend class CancellationSource;
+friend class CancellationToken;
+};
+
+// Cooperative cancellation: whoever starts the work keeps the source and hands the token down (e.g. in the coroutine's input). Nothing is stopped by force: the await()s given the token end with a std::system_error (std::errc::operation_canceled), the operations registered with it (the Reactor's, the FileRing's, the sleeps) end early and the code checking it stops itself
+class CancellationToken {
+public:
+	CancellationToken() = default; // never cancelled
+	bool isCancelled() const;
+	bool canBeCancelled() const; // false for the default one, there's no point registering anything with it
+	void throwIfCancelled() const; // a std::system_error (std::errc::operation_canceled)
+	bool subscribe(CancellationCallback&) const; // false if it's cancelled already (the callback isn't called then) or can't be cancelled at all
+	bool unsubscribe(CancellationCallback&) const; // false if the callback has been called (or is being called right now, then whatever it uses must stay alive until it has returned)
+	std::shared_ptr<Task<bool>> guard(TaskAwaiterBase&) const; // true once the task is completed, false if the token is cancelled first (the task goes on regardless); resumed on the task's executor. Abandoned along with the task if that's destroyed unresolved
+private:
+	struct State;
+	struct Link;
+	explicit CancellationToken(std::shared_ptr<State>);
+	std::shared_ptr<State> mState;
+friend class CancellationSource;
+};
+
+class CancellationSource { // the copies share the state, as the tokens do
+public:
+	CancellationSource();
+	explicit CancellationSource(CancellationToken const&); // cancelled together with the token as well (for a part of a bigger job)
+	CancellationToken token() const;
+	bool cancel(); // calls the callbacks registered (the latest first) right here; false if it's been cancelled already
+	bool isCancelled() const;
+private:
+	std::shared_ptr<CancellationToken::State> mState;
+};
+}
+#endif
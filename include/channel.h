@@ -0,0 +1,340 @@
+#ifndef AW_TASKCOROCHANNEL_H
+#define AW_TASKCOROCHANNEL_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include "taskcoroutines.h"
+
+namespace aw_coroutines {
+// A bounded channel between coroutines (any number of senders and receivers):
+//	caller.await(channel.sendAsync(std::move(row))); // suspends while the channel is full, false once it's closed
+//	std::string row;
+//	while (caller.await(channel.receiveAsync(row))) ... // suspends while it's empty, false once it's closed and drained
+// The values go through a ring buffer (Dmitry Vyukov's bounded MPMC queue): a send or a receive that doesn't have to wait is a single CAS, no lock and no allocation. One that has to wait parks a node on its coroutine's stack holding a Task<bool>, and the coroutine awaits that task as any other; whoever makes room or brings a value completes it. The mutex is taken only to park a node or to hand over to the parked ones
+// A coroutine on the shared stacks (the copy-stack mode) can't await a channel (it throws a std::logic_error): its stack isn't there while it's suspended
+
+template <class T>
+class Channel;
+
+template <class T>
+struct ChannelWaiter { // a parked send or receive, on the stack of the coroutine awaiting its task
+	ChannelWaiter(T* pValue, Executor* pExecutor) : mValue(pValue) { mTask.setExecutor(pExecutor); }
+	Task<bool> mTask;
+	T* mValue; // the value to send or where to receive it
+	bool mResult = false;
+	ChannelWaiter* mNext = nullptr;
+};
+
+template <class T>
+class ChannelSend { // awaited right away: caller.await(channel.sendAsync(value))
+public:
+	ChannelSend(ChannelSend&&) = default;
+private:
+	ChannelSend(Channel<T>& rChannel, T&& value) : mChannel(rChannel), mValue(std::move(value)) {}
+	Channel<T>& mChannel;
+	T mValue;
+friend class Channel<T>;
+#if __cpp_concepts >= 201507
+template <NonReference TCallerInput, NonReference TCallerResult>
+	requires MoveConstructible<TCallerInput> && MoveConstructible<TCallerResult>
+#else
+template <class TCallerInput, class TCallerResult>
+#endif
+friend class Caller;
+};
+
+template <class T>
+class ChannelReceive { // awaited right away: caller.await(channel.receiveAsync(destination))
+private:
+	ChannelReceive(Channel<T>& rChannel, T& rDestination) : mChannel(rChannel), mDestination(rDestination) {}
+	Channel<T>& mChannel;
+	T& mDestination;
+friend class Channel<T>;
+#if __cpp_concepts >= 201507
+template <NonReference TCallerInput, NonReference TCallerResult>
+	requires MoveConstructible<TCallerInput> && MoveConstructible<TCallerResult>
+#else
+template <class TCallerInput, class TCallerResult>
+#endif
+friend class Caller;
+};
+
+template <class T>
+class Channel {
+public:
+	explicit Channel(size_t capacity, Executor* = &Executor::defaultExecutor()); // rounded up to a power of 2 (at least 2); the executor the parked coroutines are resumed on, nullptr resumes them right on the thread that has unparked them
+	~Channel(); // closes it, nobody may be using it anymore
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+	bool trySend(T&&); // false if it's full or closed, the value is moved from only if it's sent
+	bool tryReceive(T&); // false if it's empty
+	ChannelSend<T> sendAsync(T); // to be awaited by a coroutine: true once the value is in, false if the channel is (or gets) closed first
+	ChannelReceive<T> receiveAsync(T&); // to be awaited by a coroutine: true once a value has been moved into the destination, false if the channel is closed and empty
+	void close(); // the parked sends end with false, the values already in can still be received
+	bool isClosed() const;
+	size_t capacity() const;
+private:
+	struct Cell {
+		std::atomic<size_t> sequence; // free for the sender of the position, or full for the receiver of the position minus 1
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+	struct WaiterList { // FIFO
+		ChannelWaiter<T>* head = nullptr;
+		ChannelWaiter<T>* tail = nullptr;
+		void push(ChannelWaiter<T>* pWaiter) {
+			pWaiter->mNext = nullptr;
+			(tail ? tail->mNext : head) = pWaiter;
+			tail = pWaiter;
+		}
+		ChannelWaiter<T>* pop() {
+			ChannelWaiter<T>* pWaiter = head;
+			if ((head = pWaiter->mNext) == nullptr)
+				tail = nullptr;
+			return pWaiter;
+		}
+	};
+	bool push(T&&);
+	bool pop(T&);
+	void park(ChannelWaiter<T>&, bool sending); // resolves the waiter's task right away if it doesn't have to wait after all
+	void handOver(); // after a value has gone in or out: serves the parked waiters the ring has got values or room for
+	static void resolve(ChannelWaiter<T>*); // a list of them, out of the lock
+
+	std::unique_ptr<Cell[]> mCells;
+	size_t const mMask;
+	Executor* const mExecutor;
+	char mPadding0[64]; // the senders and the receivers on separate cache lines (not alignas, a channel may be created with a plain new in C++14)
+	std::atomic<size_t> mSendPos{0};
+	char mPadding1[64];
+	std::atomic<size_t> mReceivePos{0};
+	char mPadding2[64];
+	std::atomic<size_t> mWaiting{0}; // parked senders and receivers (or just about to be), checked after every value in or out
+	std::atomic<bool> mClosed{false};
+	std::mutex mMtx; // the waiter lists and the closing
+	WaiterList mSenders;
+	WaiterList mReceivers;
+
+#if __cpp_concepts >= 201507
+template <NonReference TCallerInput, NonReference TCallerResult>
+	requires MoveConstructible<TCallerInput> && MoveConstructible<TCallerResult>
+#else
+template <class TCallerInput, class TCallerResult>
+#endif
+friend class Caller;
+};
+
+// TEMPLATED MEMBERS DEFINITIONS
+template <class T>
+Channel<T>::Channel(size_t capacity, Executor* pExecutor) : mMask([capacity]{ size_t size = 2; while (size < capacity) size <<= 1; return size; }() - 1), mExecutor(pExecutor) { // one cell wouldn't do, a full one would look free for the next lap
+	mCells.reset(new Cell[mMask + 1]);
+	for (size_t i = 0; i <= mMask; ++i)
+		mCells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template <class T>
+Channel<T>::~Channel() {
+	close();
+	for (size_t pos = mReceivePos.load(std::memory_order_relaxed); pos != mSendPos.load(std::memory_order_relaxed); ++pos) // what's left unreceived
+		reinterpret_cast<T*>(mCells[pos & mMask].storage)->~T();
+}
+
+template <class T>
+bool Channel<T>::push(T&& value) {
+	size_t pos = mSendPos.load(std::memory_order_relaxed);
+	Cell* pCell;
+	while (true) {
+		pCell = &mCells[pos & mMask];
+		intptr_t diff = static_cast<intptr_t>(pCell->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+		if (!diff) {
+			if (mSendPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			return false; // full
+		else
+			pos = mSendPos.load(std::memory_order_relaxed);
+	}
+	new (pCell->storage) T(std::move(value)); // if this throws the cell is lost for good (the unrecoverable error)
+	pCell->sequence.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+template <class T>
+bool Channel<T>::pop(T& rDestination) {
+	size_t pos = mReceivePos.load(std::memory_order_relaxed);
+	Cell* pCell;
+	while (true) {
+		pCell = &mCells[pos & mMask];
+		intptr_t diff = static_cast<intptr_t>(pCell->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1);
+		if (!diff) {
+			if (mReceivePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			return false; // empty (or the sender of the cell hasn't finished yet)
+		else
+			pos = mReceivePos.load(std::memory_order_relaxed);
+	}
+	T& rValue = *reinterpret_cast<T*>(pCell->storage);
+	rDestination = std::move(rValue);
+	rValue.~T();
+	pCell->sequence.store(pos + mMask + 1, std::memory_order_release); // free for the sender one lap later
+	return true;
+}
+
+template <class T>
+bool Channel<T>::trySend(T&& value) {
+	if (mClosed.load(std::memory_order_acquire) || !push(std::move(value)))
+		return false;
+	handOver();
+	return true;
+}
+
+template <class T>
+bool Channel<T>::tryReceive(T& rDestination) {
+	if (!pop(rDestination))
+		return false;
+	handOver();
+	return true;
+}
+
+template <class T>
+void Channel<T>::handOver() {
+	std::atomic_thread_fence(std::memory_order_seq_cst); // the value in (or out) before the check, as the park() counts itself before it tries again: one of the two sees the other
+	if (!mWaiting.load(std::memory_order_relaxed))
+		return;
+	ChannelWaiter<T>* pDone = nullptr;
+	{
+		std::unique_lock<std::mutex> lk(mMtx);
+		bool moved = true;
+		while (moved) { // a value taken out for a receiver makes room for a sender and the other way round
+			moved = false;
+			while (mReceivers.head && pop(*mReceivers.head->mValue)) {
+				ChannelWaiter<T>* pWaiter = mReceivers.pop();
+				pWaiter->mResult = moved = true;
+				pWaiter->mNext = pDone;
+				pDone = pWaiter;
+				mWaiting.fetch_sub(1, std::memory_order_relaxed);
+			}
+			while (mSenders.head && push(std::move(*mSenders.head->mValue))) {
+				ChannelWaiter<T>* pWaiter = mSenders.pop();
+				pWaiter->mResult = moved = true;
+				pWaiter->mNext = pDone;
+				pDone = pWaiter;
+				mWaiting.fetch_sub(1, std::memory_order_relaxed);
+			}
+		}
+	}
+	resolve(pDone);
+}
+
+template <class T>
+void Channel<T>::park(ChannelWaiter<T>& rWaiter, bool sending) {
+	std::unique_lock<std::mutex> lk(mMtx);
+	mWaiting.fetch_add(1); // sequentially consistent, before we try again (see the handOver())
+	bool closed = mClosed.load(std::memory_order_relaxed); // it's closed under the mutex
+	bool done = sending ? !closed && push(std::move(*rWaiter.mValue)) : pop(*rWaiter.mValue);
+	if (done || closed) { // no need to wait after all
+		mWaiting.fetch_sub(1, std::memory_order_relaxed);
+		lk.unlock();
+		rWaiter.mResult = done;
+		rWaiter.mTask.setResult(done);
+		if (done)
+			handOver();
+		return;
+	}
+	(sending ? mSenders : mReceivers).push(&rWaiter);
+}
+
+template <class T>
+void Channel<T>::resolve(ChannelWaiter<T>* pWaiter) {
+	while (pWaiter) {
+		ChannelWaiter<T>* pNext = pWaiter->mNext; // the waiter is gone once its coroutine is resumed
+		pWaiter->mTask.setResult(pWaiter->mResult);
+		pWaiter = pNext;
+	}
+}
+
+template <class T>
+ChannelSend<T> Channel<T>::sendAsync(T value) {
+	return ChannelSend<T>(*this, std::move(value));
+}
+
+template <class T>
+ChannelReceive<T> Channel<T>::receiveAsync(T& rDestination) {
+	return ChannelReceive<T>(*this, rDestination);
+}
+
+template <class T>
+void Channel<T>::close() {
+	ChannelWaiter<T>* pDone = nullptr;
+	{
+		std::unique_lock<std::mutex> lk(mMtx);
+		if (mClosed.exchange(true, std::memory_order_acq_rel))
+			return;
+		while (mReceivers.head) { // the ring was empty when they parked, a value may have come since
+			ChannelWaiter<T>* pWaiter = mReceivers.pop();
+			pWaiter->mResult = pop(*pWaiter->mValue);
+			pWaiter->mNext = pDone;
+			pDone = pWaiter;
+			mWaiting.fetch_sub(1, std::memory_order_relaxed);
+		}
+		while (mSenders.head) {
+			ChannelWaiter<T>* pWaiter = mSenders.pop();
+			pWaiter->mResult = false;
+			pWaiter->mNext = pDone;
+			pDone = pWaiter;
+			mWaiting.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+	resolve(pDone);
+}
+
+template <class T>
+bool Channel<T>::isClosed() const {
+	return mClosed.load(std::memory_order_acquire);
+}
+
+template <class T>
+size_t Channel<T>::capacity() const {
+	return mMask + 1;
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TValue>
+bool Caller<TInput, TResult>::await(ChannelSend<TValue> send) {
+	if (mWholeState->mState.sharedStack) // the waiter and the value are on our stack, the channel writes through them while we're suspended (and the stack is somebody else's)
+		throw std::logic_error("A channel can't be awaited from a coroutine on the shared stacks.");
+	if (send.mChannel.trySend(std::move(send.mValue)))
+		return true;
+	ChannelWaiter<TValue> waiter(&send.mValue, send.mChannel.mExecutor);
+	send.mChannel.park(waiter, true);
+	return await(waiter.mTask); // the task is on our stack, nobody else holds it
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TValue>
+bool Caller<TInput, TResult>::await(ChannelReceive<TValue> receive) {
+	if (mWholeState->mState.sharedStack) // as above, and so is the destination
+		throw std::logic_error("A channel can't be awaited from a coroutine on the shared stacks.");
+	if (receive.mChannel.tryReceive(receive.mDestination))
+		return true;
+	ChannelWaiter<TValue> waiter(&receive.mDestination, receive.mChannel.mExecutor);
+	receive.mChannel.park(waiter, false);
+	return await(waiter.mTask);
+}
+}
+#endif
@@ -1,53 +1,78 @@
 #ifndef AW_TASKCOROCOMMON_H
 #define AW_TASKCOROCOMMON_H
 
-#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <exception>
 #include <memory>
+#include <stdexcept>
 #include "coro-concepts.h"
 
 namespace aw_coroutines {
-void copyNestedExceptionInfo(char*, const std::exception&, size_t, bool = true);
+struct StackState { // The registers themselves are kept on the stacks of the suspended contexts (see coro-switch.h), here are only their stack pointers
+	void* callerContext; // the context which has launched or resumed the coroutine (suspended while the coroutine runs)
+	void* coroutineContext; // the suspended coroutine
 
-class Coroutine_error: public std::runtime_error {
-public:
-	explicit Coroutine_error(const std::string& what_arg);
-	explicit Coroutine_error(const char* what_arg);
+	size_t stackStoragePointer; // taken from the StackPool
+	size_t stackSize;
+	size_t sharedStack; // the shared stack the coroutine is bound to (copy-stack mode) or 0
+	size_t savedStack; // where the used part of the shared stack is kept while the coroutine is suspended
+	size_t savedStackLength;
+	size_t savedStackCapacity;
+	bool finished; // the coroutine has ended and left its stack for good
+	void (*routine)(); // the Caller's routine the stack's depth is recorded for (see the StackPool::setDepthTracking()), cleared when the stack is acquired without the tracking
 };
 
 class TaskAwaiterBase;
-class AwaiterCallbackBase {
+class Executor;
+class AwaiterCallbackBase { // a node of the intrusive list of the callbacks registered with a task. It's a part of whoever has registered it (an awaiting coroutine, a continuation...) and is never deleted through this class, so a pair of function pointers does instead of a vtable and a virtual destructor
 public:
-	AwaiterCallbackBase() = default; // lines below would prevent implicit generation of the default constructor
-	virtual ~AwaiterCallbackBase() = default;
 	AwaiterCallbackBase(const AwaiterCallbackBase&) = delete;
 	AwaiterCallbackBase& operator=(const AwaiterCallbackBase&) = delete;
 	// move semantics will be deleted also
-	virtual void operator()() = 0;
-	virtual void operator()(void const*) {};
+protected:
+	typedef void (*Function)(AwaiterCallbackBase&); // gets the derived object with a static_cast
+	explicit AwaiterCallbackBase(Function completed, Function abandoned = nullptr) : mCompleted(completed), mAbandoned(abandoned) {}
+	~AwaiterCallbackBase() = default;
+private:
+	Function mCompleted; // the task has been completed, or already was when the callback was registered
+	Function mAbandoned; // the task is being destroyed without being completed
+	AwaiterCallbackBase* mNext = nullptr; // callbacks registered with a task form a list
+friend class TaskAwaiterBase;
 };
 
 class TaskAwaiterBase {
 public:
-	bool isCompleted();
-	void onCompleted(std::unique_ptr<AwaiterCallbackBase>);
+	TaskAwaiterBase();
+	~TaskAwaiterBase();
+	TaskAwaiterBase(const TaskAwaiterBase&) = delete;
+	TaskAwaiterBase& operator=(const TaskAwaiterBase&) = delete;
+	bool isCompleted() const;
+	void onCompleted(AwaiterCallbackBase&); // the callback goes right away if the task is completed. It must outlive the task or be called first; any number of callbacks can be registered and they're called in order
+	void setExecutor(Executor*); // where the coroutines awaiting this task are resumed, nullptr means right away on the thread resolving it (for hot, tiny continuations). Set it before the task is awaited
+	Executor* getExecutor() const;
+	std::exception_ptr getException() const; // the exception the task has ended with, nullptr if it has a result or isn't completed yet (to check for an error without a throw)
 protected:
-	char const* hasErrors() const;
-	void setError(const std::exception&);
-	std::mutex mMtx;
-	bool mCompleted = false;
-	std::unique_ptr<AwaiterCallbackBase> mOnCompletedCallback;
-	char mExcWhats[256];
-	bool mError = false;
+	void rethrowIfFailed() const; // the original exception, of its own type
+	void setError(std::exception_ptr);
+	void complete(); // publishes the result (or the error) set before and calls the callbacks
+	void waitForCompletion();
+	bool registerCallback(AwaiterCallbackBase*); // false if the task is completed
+	static constexpr uintptr_t pending = 0;
+	static constexpr uintptr_t completed = 1;
+	std::atomic<uintptr_t> mState{pending}; // pending, the head of the list of the callbacks registered or completed; every change is a single CAS (or exchange)
+	Executor* mExecutor;
+	std::exception_ptr mException;
 
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
 friend class Caller;
 
-template <class TTask, class TResult>
+template <class TResult>
 friend class AwaiterCallbackUnsink;
 };
 }
@@ -6,7 +6,7 @@ template <class T>
 concept bool NonReference = !std::is_reference<T>::value;
 
 template <class T>
-concept bool CopyConstructible = std::is_copy_constructible<T>::value;
+concept bool MoveConstructible = std::is_move_constructible<T>::value; // move-only inputs and results (e.g. std::unique_ptr) are fine
 #endif
 }
 #endif
@@ -0,0 +1,86 @@
+#ifndef AW_TASKCOROSWITCH_H
+#define AW_TASKCOROSWITCH_H
+
+// The context switch is inlined into the Caller::await() and the unsink() so there's no call through the PLT. A suspended context is kept on its own stack:
+//	RSP ->	MXCSR (4 bytes), x87 control word (4 bytes)
+//		resume address
+//		RBP
+//		128 bytes of the red zone (skipped, the switch may happen in a leaf function)
+// Every other register is declared as clobbered so the compiler saves only what is live at the point of the switch (the callee-saved RBX, R12-R15 of the enclosing function get saved in its prologue as for any call)
+
+#ifdef __AVX512F__
+#define AW_SWITCH_CLOBBERS_AVX512 , "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22", "xmm23", "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29", "xmm30", "xmm31"
+#else
+#define AW_SWITCH_CLOBBERS_AVX512
+#endif
+
+#define AW_SWITCH_CLOBBERS "rax", "rbx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", \
+	"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15", \
+	"st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)", "memory", "cc" AW_SWITCH_CLOBBERS_AVX512
+
+#define AW_SWITCH_SAVE \
+	"leaq 1f(%%rip), %%rax\n\t" \
+	"subq $128, %%rsp\n\t" \
+	"pushq %%rbp\n\t" \
+	"pushq %%rax\n\t" \
+	"pushq $0\n\t" \
+	"stmxcsr (%%rsp)\n\t" \
+	"fnstcw 4(%%rsp)\n\t"
+
+namespace aw_coroutines {
+// saves the current context, stores its stack pointer in the *from and resumes the context suspended at the to
+__attribute__((always_inline)) inline void switchContext(void** from, void* to) noexcept {
+	asm volatile(
+		AW_SWITCH_SAVE
+		"movl (%%rsp), %%ecx\n\t"
+		"movzwl 4(%%rsp), %%edx\n\t"
+		"movq %%rsp, (%%rdi)\n\t"
+		"movq %%rsi, %%rsp\n\t"
+		// loading the control registers is expensive so it's done only if the other context has got different control bits (the MXCSR exception flags are not callee-saved and aren't compared nor restored)
+		"movl (%%rsp), %%eax\n\t"
+		"xorl %%ecx, %%eax\n\t"
+		"testl $0xffc0, %%eax\n\t"
+		"jnz 3f\n\t"
+		"cmpw 4(%%rsp), %%dx\n\t"
+		"je 2f\n"
+		"3:\n\t"
+		"andl $0x3f, %%ecx\n\t"
+		"andl $0xffc0, (%%rsp)\n\t"
+		"orl %%ecx, (%%rsp)\n\t"
+		"ldmxcsr (%%rsp)\n\t"
+		"fldcw 4(%%rsp)\n"
+		"2:\n\t"
+		"addq $8, %%rsp\n\t"
+		"popq %%rax\n\t"
+		"popq %%rbp\n\t"
+		"jmpq *%%rax\n"
+		"1:\n\t"
+		"addq $128, %%rsp\n\t"
+		: "+D"(from), "+S"(to)
+		:
+		: "rcx", "rdx", AW_SWITCH_CLOBBERS
+	);
+}
+
+// saves the current context, stores its stack pointer in the *from and calls the entry(arg) on the stack whose top is given; the entry must never return, it leaves with the switchContext()
+__attribute__((always_inline)) inline void startContext(void** from, void* stackTop, void (*entry)(void*), void* arg) noexcept {
+	asm volatile(
+		AW_SWITCH_SAVE
+		"movq %%rsp, (%%rdx)\n\t"
+		"movq %%rsi, %%rsp\n\t"
+		"xorl %%ebp, %%ebp\n\t" // the outermost frame on this stack
+		"callq *%%rcx\n\t" // the top is 16-byte aligned so the RSP + 8 is too, as for any called function
+		"ud2\n"
+		"1:\n\t"
+		"addq $128, %%rsp\n\t"
+		: "+D"(arg), "+S"(stackTop), "+d"(from), "+c"(entry)
+		:
+		: AW_SWITCH_CLOBBERS
+	);
+}
+}
+
+#undef AW_SWITCH_SAVE
+#undef AW_SWITCH_CLOBBERS
+#undef AW_SWITCH_CLOBBERS_AVX512
+#endif
@@ -0,0 +1,54 @@
+#ifndef AW_TASKCOROEXECUTOR_H
+#define AW_TASKCOROEXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace aw_coroutines {
+// Worker threads resuming the coroutines whose awaited tasks have been resolved (so the thread calling the setResult() doesn't run the continuation itself)
+// Every worker has its own deque: jobs posted from a worker go to the back of its deque and it takes them from the back (the most recent, still warm in the cache), idle workers steal from the front of the others. Jobs posted from any other thread are dealt out to the workers in turn
+// The workers are started with the first job posted
+class Executor {
+public:
+	typedef std::pair<void (*)(void*), std::shared_ptr<void>> Job; // the function is called with the pointer, the shared_ptr keeps whatever it points to alive until then
+
+	explicit Executor(size_t workers = 0); // 0 means one worker for every hardware thread
+	~Executor(); // runs whatever is left and joins the workers, must not be called from one of them
+	Executor(const Executor&) = delete;
+	Executor& operator=(const Executor&) = delete;
+
+	void post(void (*)(void*), std::shared_ptr<void>);
+	size_t workers() const;
+	bool runsOnWorker() const; // the calling thread is one of our workers
+	void setUnhandledExceptionHandler(void (*)(std::exception_ptr)); // called on the worker for an exception escaping a job (by default std::terminate(), as for a std::thread)
+
+	static Executor& defaultExecutor(); // used by the tasks unless they're told otherwise; it's never destroyed (its workers are never joined)
+private:
+	struct Worker;
+	void start();
+	void work(size_t);
+	bool take(size_t, Job&);
+
+	std::unique_ptr<Worker[]> mWorkers;
+	size_t mCount;
+	std::once_flag mStarted;
+	std::atomic<size_t> mNext{0}; // the worker the next job from the outside goes to
+	std::atomic<size_t> mQueued{0}; // jobs in all the deques
+	std::atomic<size_t> mSleeping{0};
+	std::mutex mIdleMtx;
+	std::condition_variable mIdleCv;
+	bool mStop = false;
+	std::atomic<void (*)(std::exception_ptr)> mHandler{nullptr};
+};
+
+// Runs the function right away, unless the calling thread is already inside such a call: then it's queued and the outermost call runs it once the current one has returned. The coroutines resumed without an executor are resumed this way, so a cascade of coroutines completing one another runs one after another in a constant native stack instead of nesting each resumption in the one before (every finished coroutine gives its stack back before the next one runs)
+// An exception escaping one of the functions is rethrown from the outermost call after the queue has been emptied (only the first one)
+void runTrampolined(void (*)(void*), std::shared_ptr<void>);
+void handOffTrampolined(); // the jobs queued behind the calling thread's current one go to the default executor: called before the thread blocks (a task's wait()), one of them may be what it waits for
+}
+#endif
@@ -0,0 +1,105 @@
+#ifndef AW_TASKCOROFILERING_H
+#define AW_TASKCOROFILERING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include "cancellation.h"
+#include "taskcoroutines.h"
+
+struct io_uring_sqe;
+
+namespace aw_coroutines {
+// Asynchronous file I/O through an io_uring (set up with the raw syscalls, no liburing): the operations are queued in the submission ring and a completion thread resolves the tasks of every batch of completions it reaps at once
+// Operations started by several threads at the same time go to the kernel with a single io_uring_enter() (whoever comes first submits the others' as well), the ones started inside a FileRing::Batch with one at its end
+// No more operations are in flight than the completion ring has room for (twice the entries): the others are queued and go to the kernel, in order, as the earlier ones complete
+// Without a usable io_uring (older kernels, seccomp) the operations are carried out by a few threads with the blocking pread()/pwrite()/fsync() instead
+// Cancelling the token of an operation in flight asks the kernel to cancel it (IORING_OP_ASYNC_CANCEL): it ends with ECANCELED unless it's too far along to be stopped. The fallback threads check the token before the blocking call only
+class FileRing {
+public:
+	explicit FileRing(unsigned entries = 256, Executor* = &Executor::defaultExecutor()); // the size of the submission ring (the kernel rounds it up to a power of 2) and the executor of the tasks it returns
+	~FileRing(); // waits for the operations in flight, must not be called from a coroutine resumed by the ring without an executor
+	FileRing(const FileRing&) = delete;
+	FileRing& operator=(const FileRing&) = delete;
+
+	std::shared_ptr<Task<size_t>> readFileAsync(int, void*, size_t, uint64_t, CancellationToken const& = CancellationToken()); // a single pread(): the bytes read (fewer at the end of the file, 0 past it); a failure ends the task with a std::system_error
+	std::shared_ptr<Task<size_t>> writeFileAsync(int, void const*, size_t, uint64_t, CancellationToken const& = CancellationToken()); // a single pwrite(): the bytes written
+	std::shared_ptr<Task<int>> fsyncAsync(int, bool = false, CancellationToken const& = CancellationToken()); // 0 once the data (and the metadata unless the second argument is true) is on the disk
+
+	// Registered once, before the first operation: the kernel pins the buffers and takes the references to the files up front instead of on every operation. Reads and writes within a registered buffer and on a registered descriptor use them without being asked
+	void registerBuffers(std::vector<iovec> const&);
+	void registerFiles(std::vector<int> const&);
+	bool usesUring() const; // false with the fallback threads
+
+	class Batch { // the operations this thread starts on the ring while it's alive are submitted together when it ends; it mustn't be alive across an await()
+	public:
+		explicit Batch(FileRing&);
+		~Batch();
+		Batch(const Batch&) = delete;
+		Batch& operator=(const Batch&) = delete;
+	private:
+		FileRing& mRing;
+		FileRing* mOuter;
+	};
+
+	static FileRing& defaultRing(); // it's never destroyed
+private:
+	struct Cancel;
+	struct Slot { // an operation in flight
+		void (*resolve)(std::shared_ptr<void> const&, long, int);
+		std::shared_ptr<void> spTask;
+		std::shared_ptr<Cancel> spCancel; // if it's been given a token
+		uint32_t generation; // in the upper half of the user_data, so a late cancellation can't hit the next operation in the slot
+	};
+	struct Fallback;
+	struct Queue;
+	template <class T>
+	std::shared_ptr<Task<T>> start(uint8_t, int, char*, size_t, uint64_t, uint32_t, CancellationToken const&);
+	void queueSqe(io_uring_sqe const&); // under the mSqMtx: into the submission ring for the submit() if there's room (in it and for the completion), into the mQueue otherwise
+	void moveQueued(); // under the mSqMtx: as much of the mQueue as there's room for now
+	bool unqueue(uint64_t); // under the mSqMtx: takes the operation with the user_data out of the mQueue, false if it's gone to the ring already
+	void queueCancel(uint64_t); // under the mSqMtx, of the operation with the user_data
+	void submit(); // whatever is in the submission ring
+	bool enter(unsigned); // io_uring_enter() until the kernel has taken them all; false if the completion thread has to reap first, the rest is left to the submit()
+	void complete();
+
+	int mRingFd = -1;
+	unsigned mEntries = 0;
+	void* mSqRing = nullptr;
+	size_t mSqRingSize = 0;
+	void* mCqRing = nullptr;
+	size_t mCqRingSize = 0;
+	void* mSqes = nullptr;
+	size_t mSqesSize = 0;
+	unsigned* mSqHead = nullptr;
+	unsigned* mSqTail = nullptr;
+	unsigned* mSqMask = nullptr;
+	unsigned* mSqArray = nullptr;
+	unsigned* mCqHead = nullptr;
+	unsigned* mCqTail = nullptr;
+	unsigned* mCqMask = nullptr;
+	void* mCqes = nullptr;
+
+	std::mutex mSqMtx; // filling the submission ring and the slots
+	std::vector<Slot> mSlots; // of the operations in flight or queued, indexed by the lower half of their user_data; it grows as needed
+	std::vector<unsigned> mFreeSlots;
+	unsigned mCqEntries = 0;
+	unsigned mInFlight = 0; // under the mSqMtx: the entries in the submission ring or in the kernel whose completions haven't been reaped, at most the mCqEntries
+	std::unique_ptr<Queue> mQueue; // the entries there's no room for yet
+	bool mResubmit = false; // the completion thread's: it's left something unsubmitted to reap first
+	std::atomic<unsigned> mUnsubmitted{0}; // queued in the submission ring but not entered yet
+	std::atomic<bool> mSubmitting{false};
+	std::vector<iovec> mBuffers;
+	std::vector<int> mFileIndexes; // by the descriptor, -1 for the unregistered ones
+	bool mStopping = false;
+	std::thread mCompletionThread;
+	Executor* mExecutor;
+	std::unique_ptr<Fallback> mFallback;
+};
+}
+#endif
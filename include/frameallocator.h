@@ -0,0 +1,47 @@
+#ifndef AW_TASKCOROFRAMEALLOCATOR_H
+#define AW_TASKCOROFRAMEALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+
+namespace aw_coroutines {
+// Where the per-coroutine block (the state of the coroutine together with its task and the shared_ptr's control block) comes from
+// The default one keeps per-thread free lists of blocks by size class so a steady stream of coroutines doesn't touch the general-purpose heap. Any other can be plugged in, globally or for a particular Caller
+class FrameAllocator {
+public:
+	static constexpr size_t sizeClass = 64; // granularity of the default allocator
+	static constexpr size_t maxPooledSize = 4096; // bigger blocks go straight to the operator new
+	static constexpr size_t maxPooledBlocks = 64; // per thread and size class
+
+	virtual ~FrameAllocator() = default;
+	virtual void* allocate(size_t) = 0; // aligned at least as the operator new does
+	virtual void deallocate(void*, size_t) noexcept = 0; // may be called from a different thread than the allocate() was
+
+	static FrameAllocator& defaultAllocator(); // the one set with setDefault() or the built-in per-thread slab
+	static void setDefault(FrameAllocator*); // nullptr restores the built-in one; it has to outlive every block allocated with it
+};
+
+template <class T>
+class FrameAllocatorAdaptor { // for the std::allocate_shared
+public:
+	typedef T value_type;
+	explicit FrameAllocatorAdaptor(FrameAllocator& rAllocator) noexcept : mAllocator(&rAllocator) {}
+	template <class U>
+	FrameAllocatorAdaptor(FrameAllocatorAdaptor<U> const& other) noexcept : mAllocator(other.mAllocator) {}
+	T* allocate(size_t n) {
+		static_assert(alignof(T) <= alignof(std::max_align_t), "The FrameAllocator gives only what the operator new does, an over-aligned type needs an allocator of its own."); // there's no aligned operator new before C++17
+		return static_cast<T*>(mAllocator->allocate(n * sizeof(T)));
+	}
+	void deallocate(T* p, size_t n) noexcept { mAllocator->deallocate(p, n * sizeof(T)); }
+	template <class U>
+	bool operator==(FrameAllocatorAdaptor<U> const& other) const noexcept { return mAllocator == other.mAllocator; }
+	template <class U>
+	bool operator!=(FrameAllocatorAdaptor<U> const& other) const noexcept { return mAllocator != other.mAllocator; }
+private:
+	FrameAllocator* mAllocator;
+
+template <class U>
+friend class FrameAllocatorAdaptor;
+};
+}
+#endif
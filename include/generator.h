@@ -0,0 +1,267 @@
+#ifndef AW_TASKCOROGENERATOR_H
+#define AW_TASKCOROGENERATOR_H
+
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "taskcoroutines.h"
+
+namespace aw_coroutines {
+// Pull-style generators, like the boost::coroutines2::coroutine<T>::pull_type: the routine runs on a stack of its own (from the StackPool) and yields its values one at a time, the consumer pulls them:
+//	void rows(Yield<std::string>& yield, Cursor cursor) { while (cursor.fetch()) yield(cursor.row()); }
+//	for (std::string const& row : Generator<Cursor, std::string>(&rows, cursor)) ...
+// Every value costs a switch there and one back, nothing is allocated or copied: the consumer gets a reference to the very object the routine has yielded (it lives until the routine is resumed). The routine doesn't start before the first value is pulled
+
+struct GeneratorStop {}; // thrown from the yield of a generator destroyed before its routine has ended, so the routine unwinds; not a std::exception, let it through any catch (...)
+
+template <class T>
+struct GeneratorCore { // what the yield needs, the rest of the state depends on the input
+	StackState mState = {};
+	T const* mValue = nullptr; // the value yielded, nullptr before the first one and once the routine has ended
+	TaskAwaiterBase* mPending = nullptr; // the task an async generator's routine waits for, the consumer awaits it on its behalf
+	std::exception_ptr mException; // the routine has thrown, rethrown to the consumer
+	bool mStarted = false;
+	bool mStopping = false;
+
+	void suspend() { // the routine's side
+		if (mStopping) // a routine that has caught the GeneratorStop doesn't get back to the consumer either
+			throw GeneratorStop();
+		switchContext(&mState.coroutineContext, mState.callerContext); // noexcept
+		if (mStopping)
+			throw GeneratorStop();
+	}
+};
+
+template <class T>
+class Yield {
+public:
+	Yield(const Yield&) = delete;
+	Yield& operator=(const Yield&) = delete;
+	void operator()(T const& value) { // returns once the consumer wants the next value (a temporary lives until then as well)
+		mCore.mValue = &value;
+		mCore.suspend();
+	}
+protected:
+	explicit Yield(GeneratorCore<T>& rCore) : mCore(rCore) {}
+	GeneratorCore<T>& mCore;
+
+template <class TInput, class U, class TYield>
+friend class BasicGenerator;
+};
+
+template <class T>
+class AsyncYield: public Yield<T> { // the routine of an async generator may await tasks in between its values
+public:
+	template <typename TInterResult>
+	TInterResult const& await(Task<TInterResult>& rTask) {
+		if (!rTask.isCompleted()) { // back to the consumer, it suspends on the task and resumes us once it's completed
+			this->mCore.mPending = &rTask;
+			this->mCore.suspend();
+		}
+		return rTask.getResult();
+	}
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>> const& spTask) { // a copy, as the Caller::await() gives
+		return await(*spTask);
+	}
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>>&& spTask) { // the task handed over: the result is taken out of it
+		await(*spTask);
+		return spTask->takeResult();
+	}
+private:
+	explicit AsyncYield(GeneratorCore<T>& rCore) : Yield<T>(rCore) {}
+
+template <class TInput, class U, class TYield>
+friend class BasicGenerator;
+};
+
+template <class TInput, class T, class TYield>
+class BasicGenerator {
+public:
+	typedef void (*Routine)(TYield&, TInput);
+	class iterator;
+
+	BasicGenerator(Routine, TInput, size_t stackSize = 0); // 0 means the StackPool::defaultStackSize(); the shared stacks won't do, the consumer runs while the routine is suspended
+	~BasicGenerator(); // a routine that hasn't ended is unwound from its yield (with the GeneratorStop)
+	BasicGenerator(BasicGenerator&&) = default;
+	BasicGenerator& operator=(BasicGenerator&&) = delete;
+
+	bool next(); // runs the routine to its next value, false once it has ended; rethrows what the routine has thrown (only once, it has ended then)
+	T const& value() const; // the current value
+	iterator begin(); // pulls the first value unless it's been pulled already
+	iterator end();
+private:
+	struct State: GeneratorCore<T> {
+		State(Routine routine, TInput&& input) : mRoutine(routine), mInput(std::move(input)) {}
+		Routine mRoutine;
+		TInput mInput; // moved into the routine once it's started
+	};
+	static void entry(void*) noexcept;
+	void resume(); // the consumer's side: to the next value, the next task awaited or the end
+	std::shared_ptr<State> mState; // one allocation for the whole generator, it doesn't move (the routine's stack points at it)
+
+#if __cpp_concepts >= 201507
+template <NonReference TCallerInput, NonReference TCallerResult>
+	requires MoveConstructible<TCallerInput> && MoveConstructible<TCallerResult>
+#else
+template <class TCallerInput, class TCallerResult>
+#endif
+friend class Caller;
+};
+
+template <class TInput, class T>
+using Generator = BasicGenerator<TInput, T, Yield<T>>; // consumed with the next() or a range-for, from anywhere
+
+template <class TInput, class T>
+using AsyncGenerator = BasicGenerator<TInput, T, AsyncYield<T>>; // consumed by a coroutine: while (std::string const* pRow = caller.await(rows)) ...
+
+template <class TInput, class T, class TYield>
+class BasicGenerator<TInput, T, TYield>::iterator { // an input iterator: all the copies advance the same generator
+public:
+	typedef std::input_iterator_tag iterator_category;
+	typedef T value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef T const* pointer;
+	typedef T const& reference;
+
+	iterator() = default; // the end
+	T const& operator*() const { return *mGenerator->mState->mValue; }
+	T const* operator->() const { return mGenerator->mState->mValue; }
+	iterator& operator++() {
+		if (!mGenerator->next())
+			mGenerator = nullptr;
+		return *this;
+	}
+	void operator++(int) { ++*this; } // there's no copy of the previous value to return
+	bool operator==(iterator const& rOther) const { return mGenerator == rOther.mGenerator; }
+	bool operator!=(iterator const& rOther) const { return mGenerator != rOther.mGenerator; }
+private:
+	explicit iterator(BasicGenerator* pGenerator) : mGenerator(pGenerator) {}
+	BasicGenerator* mGenerator = nullptr;
+friend class BasicGenerator;
+};
+
+// TEMPLATED MEMBERS DEFINITIONS
+template <class TInput, class T, class TYield>
+BasicGenerator<TInput, T, TYield>::BasicGenerator(Routine routine, TInput input, size_t stackSize) : mState(std::allocate_shared<State>(FrameAllocatorAdaptor<State>(FrameAllocator::defaultAllocator()), routine, std::move(input))) {
+	StackState& rState = mState->mState;
+	rState.stackSize = StackPool::stackSizeFor(stackSize);
+	if (rState.stackSize == StackPool::sharedStack)
+		throw std::invalid_argument("A generator needs a stack of its own.");
+	rState.routine = reinterpret_cast<void (*)()>(routine);
+	if (!acquireStack(rState))
+		throwNoStack("generator");
+}
+
+template <class TInput, class T, class TYield>
+BasicGenerator<TInput, T, TYield>::~BasicGenerator() {
+	if (!mState) // moved from
+		return;
+	if (!mState->mStarted) {
+		releaseStack(mState->mState);
+		return;
+	}
+	if (mState->mState.finished)
+		return;
+	mState->mStopping = true; // every yield (or await) throws from now on, we're back once the routine has ended
+	mState->mPending = nullptr;
+	resume();
+}
+
+template <class TInput, class T, class TYield>
+void BasicGenerator<TInput, T, TYield>::entry(void* pState) noexcept { // called by the startContext() on the generator's stack, it leaves it for good with the switchContext()
+	State& rState = *static_cast<State*>(pState);
+	try {
+		TYield yield(rState);
+		rState.mRoutine(yield, std::move(rState.mInput));
+	} catch (GeneratorStop&) {
+	} catch (...) {
+		rState.mException = std::current_exception();
+	}
+	rState.mValue = nullptr;
+	rState.mState.finished = true;
+	void* finishedContext;
+	switchContext(&finishedContext, rState.mState.callerContext);
+	__builtin_unreachable();
+}
+
+template <class TInput, class T, class TYield>
+void BasicGenerator<TInput, T, TYield>::resume() {
+	StackState& rState = mState->mState;
+	if (mState->mStarted)
+		switchContext(&rState.callerContext, rState.coroutineContext);
+	else {
+		mState->mStarted = true;
+		startContext(&rState.callerContext, reinterpret_cast<void*>(rState.stackStoragePointer + rState.stackSize), &BasicGenerator::entry, mState.get());
+	}
+	// the routine has yielded, is waiting for a task or has ended
+	if (rState.finished)
+		releaseStack(rState);
+}
+
+template <class TInput, class T, class TYield>
+bool BasicGenerator<TInput, T, TYield>::next() {
+	if (mState->mState.finished)
+		return false;
+	resume();
+	if (mState->mPending)
+		throw std::logic_error("The generator awaits a task, it has to be awaited by a coroutine."); // an async one with a pending task, see the Caller::await()
+	if (mState->mException) {
+		std::exception_ptr error = std::move(mState->mException);
+		mState->mException = nullptr;
+		std::rethrow_exception(error);
+	}
+	return !mState->mState.finished;
+}
+
+template <class TInput, class T, class TYield>
+T const& BasicGenerator<TInput, T, TYield>::value() const {
+	if (!mState->mValue)
+		throw std::logic_error("The generator has no value.");
+	return *mState->mValue;
+}
+
+template <class TInput, class T, class TYield>
+typename BasicGenerator<TInput, T, TYield>::iterator BasicGenerator<TInput, T, TYield>::begin() {
+	if (!mState->mStarted)
+		next();
+	return iterator(mState->mValue ? this : nullptr);
+}
+
+template <class TInput, class T, class TYield>
+typename BasicGenerator<TInput, T, TYield>::iterator BasicGenerator<TInput, T, TYield>::end() {
+	return iterator();
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TGenInput, typename TValue>
+TValue const* Caller<TInput, TResult>::await(BasicGenerator<TGenInput, TValue, AsyncYield<TValue>>& rGenerator) {
+	GeneratorCore<TValue>& rCore = *rGenerator.mState;
+	if (rCore.mState.finished)
+		return nullptr;
+	rGenerator.resume();
+	while (TaskAwaiterBase* pPending = rCore.mPending) { // the routine's await(): we suspend on the task instead, the routine is resumed by us once we're resumed (on whatever thread that is)
+		rCore.mPending = nullptr;
+		if (!pPending->isCompleted())
+			suspendOn(pPending, nullptr); // the routine gets the result itself
+		rGenerator.resume();
+	}
+	if (rCore.mException) {
+		std::exception_ptr error = std::move(rCore.mException);
+		rCore.mException = nullptr;
+		std::rethrow_exception(error);
+	}
+	return rCore.mValue;
+}
+}
+#endif
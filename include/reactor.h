@@ -0,0 +1,55 @@
+#ifndef AW_TASKCOROREACTOR_H
+#define AW_TASKCOROREACTOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <sys/socket.h>
+#include "cancellation.h"
+#include "taskcoroutines.h"
+
+namespace aw_coroutines {
+// Asynchronous I/O on non-blocking descriptors (sockets, pipes, eventfd...): every operation is tried right away and returns a completed task if it doesn't have to wait. Otherwise it's parked on the descriptor and retried by an edge-triggered epoll loop once the descriptor becomes ready
+// Every loop is a thread with its own epoll instance, the descriptors are dealt out to the loops in turn. The tasks made ready by one epoll_wait() are resolved together after it has been processed
+// A descriptor takes one read (or accept) and one write (or connect) at a time; a failed operation ends its task with a std::system_error. An operation parked when its token is cancelled ends with ECANCELED (what a write has written so far is lost)
+class Reactor {
+public:
+	explicit Reactor(size_t loops = 1, Executor* = &Executor::defaultExecutor()); // the executor of the tasks it returns: nullptr resumes the awaiting coroutines right on the loop's thread (no hand-over, but they mustn't block)
+	~Reactor(); // stops the loops and ends the operations still waiting with ECANCELED, must not be called from one of the loops
+	Reactor(const Reactor&) = delete;
+	Reactor& operator=(const Reactor&) = delete;
+
+	void add(int); // makes the descriptor non-blocking and registers it (with one of the loops)
+	void remove(int); // before the descriptor is closed; the operations still waiting end with ECANCELED
+
+	std::shared_ptr<Task<size_t>> readAsync(int, void*, size_t, CancellationToken const& = CancellationToken()); // what a single read() has got, 0 at the end of the stream
+	std::shared_ptr<Task<size_t>> writeAsync(int, void const*, size_t, CancellationToken const& = CancellationToken()); // everything is written (a short write is continued), the size given
+	std::shared_ptr<Task<int>> acceptAsync(int, CancellationToken const& = CancellationToken()); // the accepted descriptor (non-blocking and close-on-exec, not added yet)
+	std::shared_ptr<Task<int>> connectAsync(int, sockaddr const*, socklen_t, CancellationToken const& = CancellationToken()); // the descriptor, once it's connected
+
+	static Reactor& defaultReactor(); // one loop and the default executor; it's never destroyed
+private:
+	struct Operation;
+	struct Completion;
+	struct Cancel;
+	struct Descriptor;
+	struct Loop;
+	Descriptor& descriptor(int);
+	template <class T>
+	std::shared_ptr<Task<T>> start(int, bool, bool (*)(int, Operation&), char*, size_t, CancellationToken const&);
+	void run(Loop&);
+	void stop() noexcept; // joins the loops and closes their descriptors
+
+	static constexpr size_t chunkSize = 1024; // descriptors in a chunk of the table
+	static constexpr size_t maxChunks = 1024;
+	std::unique_ptr<Loop[]> mLoops;
+	size_t mLoopCount;
+	std::atomic<size_t> mNextLoop{0};
+	Executor* mExecutor;
+	std::mutex mTableMtx; // only for adding chunks, the lookups don't lock
+	std::atomic<Descriptor*> mChunks[maxChunks] = {};
+	std::atomic<bool> mStopping{false};
+};
+}
+#endif
@@ -0,0 +1,58 @@
+#ifndef AW_TASKCOROSTACKPOOL_H
+#define AW_TASKCOROSTACKPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace aw_coroutines {
+class Executor;
+struct StackState;
+
+struct StackDepth { // how deep the stacks of the coroutines of one routine have gone
+	void (*routine)();
+	char const* name; // of the routine's symbol if the dynamic linker knows it (e.g. linked with -rdynamic), nullptr otherwise
+	size_t stackSize; // the largest of the stacks it was launched with
+	uint64_t coroutines; // measured
+	size_t maxDepth; // in bytes
+	size_t p50; // the percentiles are in whole pages (as the stack sizes are)
+	size_t p90;
+	size_t p99;
+};
+
+// Stacks for the coroutines are taken from this pool when they are launched and given back when they end. Every thread keeps a small cache of ready stacks and whatever doesn't fit there goes to the global list (up to its capacity). Only when both are empty a new stack is mapped
+// Stacks are mmap-ed with a PROT_NONE guard page below them (an overflow ends with SIGSEGV instead of a corrupted heap) and take physical memory only as their pages are touched
+// Every stack is two memory mappings then, and a process gets vm.max_map_count of them (65530 by default): fewer than 32k coroutines with stacks of their own can be alive at once unless it's raised (sysctl -w vm.max_map_count=262144), whatever the stack size. The shared stacks don't count
+class StackPool {
+public:
+	static constexpr size_t maxThreadCacheSize = 16;
+	static constexpr size_t minStackSize = 16384;
+	static constexpr size_t sharedStack = static_cast<size_t>(-1); // passed to the Caller instead of a stack size makes its coroutines run on the shared stacks (copy-stack mode)
+
+	static void setDefaultStackSize(size_t); // used by the Callers constructed without a stack size (8MB by default); a smaller stack takes less address space but not fewer mappings, see above
+	static size_t defaultStackSize();
+	static size_t stackSizeFor(size_t); // the actual size of a stack requested with the given size (0 means the default), rounded up to whole pages
+	static void setCapacity(size_t); // how many idle stacks the global list may keep; stacks above that are unmapped
+	static size_t capacity();
+	static void setThreadCacheSize(size_t); // how many idle stacks every thread may keep for itself (at most maxThreadCacheSize)
+	static size_t threadCacheSize();
+	static void prewarm(size_t, size_t = 0); // maps stacks (of the given size, 0 means the default) up front and puts them on the global list (no more than the capacity allows)
+	static size_t idleStacks(); // stacks on the global list
+	static void trim(); // unmaps every stack on the global list
+	static void setSharedStacks(size_t, size_t = 0); // how many shared stacks there are and of what size (0 means the default); only before the first coroutine is launched on them
+	static void setDepthTracking(bool); // opt-in: every stack is emptied of its pages when acquired and measured when the coroutine ends (a syscall on both ends). The stacks of the coroutines launched while it's on are measured, their own stacks only (not the shared ones)
+	static std::vector<StackDepth> depthReport(); // by the routine, the deepest one first
+};
+
+bool acquireStack(StackState&) noexcept; // sets the stack pointer and size in the StackState, false if there's no stack to be had
+[[noreturn]] void throwNoStack(char const*); // after the acquireStack() has failed: the std::system_error saying why (e.g. the vm.max_map_count), the argument is what the stack was for
+void releaseStack(StackState&) noexcept; // once the coroutine has ended; a shared stack is released with the releaseSharedStack() though
+
+// Copy-stack mode: the coroutine is bound to one of the shared stacks for its whole life and holds it only while running. When it suspends the used part of the stack is copied aside and copied back before it resumes
+bool acquireSharedStack(StackState&, void (*)(void*), std::shared_ptr<void>, Executor*); // false if the stack is busy; once it's released the function is called with the pointer instead, posted to the executor (run on the trampoline for nullptr)
+void saveSharedStack(StackState&);
+void restoreSharedStack(StackState&) noexcept;
+void releaseSharedStack(StackState&); // hands the stack over to the coroutine that waited for it first, if any
+}
+#endif
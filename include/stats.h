@@ -0,0 +1,78 @@
+#ifndef AW_TASKCOROSTATS_H
+#define AW_TASKCOROSTATS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace aw_coroutines {
+// What is counted. The coroutines are counted when the library and the code including the taskcoroutines.h are compiled with the AW_STATS defined (the hooks are compiled out otherwise), the stacks and the wait() calls which have to wait by the library itself (those end in a syscall anyway)
+enum class StatsCounter : uint8_t {
+	launched, // Caller::operator()
+	finished, // the coroutine has ended (with a result or an exception) and left its stack
+	abandoned, // the task a suspended coroutine awaited has been destroyed unresolved, the coroutine will never be resumed
+	awaitsCompleted, // await() of a completed task, no suspension
+	awaitsSuspended, // await() of a pending task, the coroutine has switched out
+	stacksMapped,
+	stacksUnmapped,
+	stackBytesMapped, // the guard pages included
+	stackBytesUnmapped,
+	waits, // Task::wait() of a pending task
+	count
+};
+
+enum class StatsLatency : uint8_t {
+	suspension, // from the switch out in the await() to the switch back in (on whichever thread)
+	waitBlocking, // the wait() calls which haven't found the task completed, from the call to the return
+	count
+};
+
+struct LatencyHistogram {
+	static constexpr size_t buckets = 40;
+	uint64_t counts[buckets]; // the counts[i] are the latencies of [2^i, 2^(i+1)) nanoseconds (the counts[0] includes the 0, the last one everything above)
+	uint64_t count;
+	uint64_t sumNanoseconds;
+	uint64_t percentile(double) const; // e.g. 0.99, the upper bound of the bucket it falls in (0 if nothing has been recorded)
+};
+
+struct StatsSnapshot { // the totals since the start of the process, summed over the threads when taken
+	uint64_t nanoseconds; // the steady_clock at the time of the snapshot
+	uint64_t launched;
+	uint64_t finished;
+	uint64_t abandoned;
+	uint64_t live; // launched but neither finished nor abandoned
+	uint64_t suspended; // live and switched out in an await()
+	uint64_t awaitsCompleted;
+	uint64_t awaitsSuspended;
+	uint64_t stacksMapped; // the ones mapped right now (in use, cached or shared)
+	uint64_t stackBytesMapped;
+	uint64_t waits; // the ones that had to wait, the waitBlocking has their latencies
+	double launchesPerSecond; // since the previous snapshot (since the first thing counted for the first one)
+	LatencyHistogram suspension;
+	LatencyHistogram waitBlocking;
+};
+
+// Every thread counts into its own shard (no locks and no shared cache lines, the shards outlive their threads); the snapshot sums them up. Counting is a call and a couple of plain stores
+class Stats {
+public:
+	static StatsSnapshot snapshot(); // the counters a thread is changing meanwhile may be off by the change in progress
+	static void count(StatsCounter, uint64_t = 1) noexcept;
+	static void record(StatsLatency, uint64_t) noexcept; // in nanoseconds
+	static uint64_t now() noexcept; // the steady_clock in nanoseconds
+};
+}
+
+#ifdef AW_STATS
+#define AW_STATS_COUNT(counter) ::aw_coroutines::Stats::count(::aw_coroutines::StatsCounter::counter)
+#define AW_STATS_SETTING libraryBuiltWithStats
+#else
+#define AW_STATS_COUNT(counter) ((void)0)
+#define AW_STATS_SETTING libraryBuiltWithoutStats
+#endif
+
+namespace aw_coroutines {
+extern char const AW_STATS_SETTING; // as with the AW_TRACING (see tracing.h): the library and all the code using it agree on the AW_STATS (the root makefile's STATS=1), or it doesn't link
+namespace {
+__attribute__((used)) char const* const statsSetting = &AW_STATS_SETTING;
+}
+}
+#endif
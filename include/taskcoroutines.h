@@ -1,19 +1,25 @@
 #ifndef AW_TASKCORO_H
 #define AW_TASKCORO_H
 
-#include <condition_variable>
-#include <functional>
+#include <chrono>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include "cancellation.h"
 #include "common.h"
 #include "coro-concepts.h"
+#include "coro-switch.h"
+#include "executor.h"
+#include "frameallocator.h"
+#include "stackpool.h"
+#include "stats.h"
+#include "timers.h"
+#include "tracing.h"
 
 #if __cpp_lib_optional >= 201603
 #include <optional>
 #endif
 
-extern "C" void sink_asm(void*);
-extern "C" int saveandswitch_asm(void*);
-extern "C" int unsink_asm(void*);
-
 namespace aw_coroutines {
 
 template <class T>
@@ -23,7 +29,8 @@ public:
 		if (hasResult)
 			reinterpret_cast<T*>(resultPlaceholder)->~T();
 	}
-	T getResult();
+	T const& getResult(); // the result stays in the task (every reader gets the same one); rethrows the exception if the task has ended with one
+	T takeResult(); // moves the result out, only for a task nobody else reads
 	T const* getResultPointer();
 protected:
 	T* mResult = reinterpret_cast<T*>(resultPlaceholder);
@@ -32,107 +39,155 @@ private:
 	alignas(T) char resultPlaceholder[sizeof(T)]; // we use this insted of the std::optional beacause we want a stable address of a result that the mResult holds
 };
 
+template <class TResult, class F, class TArg>
+struct ContinuationResult { // given explicitly
+	typedef TResult type;
+};
+
+template <class F, class TArg>
+struct ContinuationResult<void, F, TArg> { // deduced from the callable
+	typedef typename std::decay<decltype(std::declval<F&>()(std::declval<TArg&>()))>::type type;
+};
+
 template <class T>
 class Task: public TaskAwaiter<T> {
 public:
-	template<typename TResult>
-	std::shared_ptr<Task<TResult>> continueWith(std::function<TResult(Task<T>&)>);
+	template <typename TResult = void, class F> // the TResult can be given (e.g. to convert the result) or it's whatever the callable returns
+	std::shared_ptr<Task<typename ContinuationResult<TResult, F, Task<T>>::type>> continueWith(F); // any callable taking Task<T>&, stored together with the returned task in a single allocation
 	TaskAwaiter<T> *getAwaiter();
-	void setResult(T result);
-	void setException(const std::exception&);
-	void wait();
+	void setResult(T const&);
+	void setResult(T&&);
+	void setException(std::exception_ptr); // e.g. the std::current_exception(), it's rethrown as it is (of its original type) to whoever gets to the result
+	template <class TException>
+	void setException(TException); // same for an exception object (of or derived from the std::exception)
+	void wait(); // spins for a moment and then sleeps on a futex until the task is completed
+private:
+	void resolve(T&&, void const*); // the pointer tags the trace event: the task itself, or the coroutine whose task it is
+	void fail(std::exception_ptr, void const*);
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+friend class Caller;
+};
+
+template<class TResult>
+struct WholeState;
+
+template <class T>
+class AsyncYield;
+template <class TInput, class T, class TYield>
+class BasicGenerator;
+template <class T>
+class ChannelSend;
+template <class T>
+class ChannelReceive;
+
+template <class TResult>
+class AwaiterCallbackUnsink: public AwaiterCallbackBase { // intrusive: a coroutine awaits one task at a time so every WholeState has one of these
+public:
+	AwaiterCallbackUnsink() : AwaiterCallbackBase(&completed, &abandoned) {}
+	void arm(std::shared_ptr<WholeState<TResult>>, TaskAwaiterBase*, void const*);
 private:
-	std::condition_variable cv;
-	std::unique_ptr<AwaiterCallbackBase> mContinueWithCallback;
+	static void completed(AwaiterCallbackBase&);
+	static void abandoned(AwaiterCallbackBase&);
+
+	std::shared_ptr<WholeState<TResult>> mWholeState; // keeps the WholeState (and thus us) alive while the coroutine is suspended; released when we're called or the task is gone
+	TaskAwaiterBase* mAwaiter = nullptr;
+	void const* mResult = nullptr; // where the result of the awaited task will be
 };
 
 template<class TResult>
-struct WholeState {
-	struct StackState { // It might be as well an array. Struct was chosen for some clarity. All members are of the size_t type so there is no padding
-		size_t save_returnAddress; // At the position 0; the return address of the save_asm()
-		size_t save_RSP;
-		size_t save_RBP;
-		size_t save_RBX;
-		size_t save_R12;
-		size_t save_R13;
-		size_t save_R14;
-		size_t save_R15; // at the position 56
-
-		size_t sink_returnAddress; // at the position 64
-		size_t sink_RSP;
-		size_t sink_RBP;
-		size_t sink_RBX;
-		size_t sink_R12;
-		size_t sink_R13;
-		size_t sink_R14;
-		size_t sink_R15; // at the position 120
-
-		size_t stackStoragePointer; // at the position 128 (8MB)
-		size_t returnAddressPointer; // at the position 136
-		size_t stackOffset; // at the position 144
-	} mState;
+struct WholeState: std::enable_shared_from_this<WholeState<TResult>> {
+	StackState mState;
 	void const* mResolvedValue;
-	std::mutex mMtx;
-	std::shared_ptr<Task<TResult>> mTask = std::make_shared<Task<TResult>>(); // from C++20 you could use the atomic_shared_ptr
+	Task<TResult> mTask; // handed out with the aliasing shared_ptr so the WholeState, the task and the control block are a single allocation
 	TaskAwaiterBase* mTaskAwaiter = nullptr;
-	std::unique_ptr<AwaiterCallbackBase> mTaskAwaiterCallback;
-	char caughtException[256];
-	bool isCaught = false;
+	AwaiterCallbackUnsink<TResult> mTaskAwaiterCallback;
+	std::exception_ptr mCaughtException; // an unrecoverable error to be thrown by whoever has launched or resumed the coroutine
 };
 
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
 class Caller {
 public:
-	Caller(TResult (*)(Caller, TInput));
+	Caller(TResult (*)(Caller, TInput), size_t stackSize = 0, FrameAllocator* = nullptr); // 0 means the StackPool::defaultStackSize(), nullptr the FrameAllocator::defaultAllocator() at the time of the call
 	std::shared_ptr<Task<TResult>> operator()(TInput);
 	template <typename TInterResult>
-	TInterResult await(Task<TInterResult>&);
+	TInterResult const& await(Task<TInterResult>&); // the result stays in the task, every coroutine awaiting it gets the same one
+	template <typename TInterResult>
+	TInterResult const& await(Task<TInterResult>&, std::chrono::nanoseconds); // throws a std::system_error (std::errc::timed_out) if the task isn't completed in time, the task goes on regardless (timed by the TimerWheel::defaultWheel())
+	template <typename TInterResult>
+	TInterResult const& await(Task<TInterResult>&, CancellationToken const&); // throws a std::system_error (std::errc::operation_canceled) right away if the token is (or gets) cancelled before the task is completed
+	// Awaiting a std::shared_ptr to a task gives the result by value. Handing the task over (a temporary or std::move()) takes the result out of it: this coroutine must be the only one getting the result (others may still wait() for the task). Otherwise it's a copy
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>> const&);
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>>&&);
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>> const&, std::chrono::nanoseconds);
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>>&&, std::chrono::nanoseconds);
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>> const&, CancellationToken const&);
+	template <typename TInterResult>
+	TInterResult await(std::shared_ptr<Task<TInterResult>>&&, CancellationToken const&);
+	template <typename TGenInput, typename TValue>
+	TValue const* await(BasicGenerator<TGenInput, TValue, AsyncYield<TValue>>&); // the next value of an async generator (see generator.h), valid until it's awaited again; nullptr once the generator has ended
+	template <typename TValue>
+	bool await(ChannelSend<TValue>); // a Channel's sendAsync() (see channel.h): false if the channel is closed
+	template <typename TValue>
+	bool await(ChannelReceive<TValue>); // a Channel's receiveAsync(): false if the channel is closed and empty
 	void unsink(void const*);
 private:
-	WholeState<TResult> *firstLevel(TInput*) noexcept;
+	struct Launch {
+		Caller* mCaller;
+		TInput* mArg;
+		WholeState<TResult>* mWholeState;
+	};
+	static void firstLevel(void*) noexcept;
 	void secondLevel(TInput*, WholeState<TResult>*) noexcept;
+	void suspendOn(TaskAwaiterBase*, void const*); // until the task (not completed yet) is, the unsink() gets the pointer to its result
 	std::shared_ptr<WholeState<TResult>> mWholeState;
 	TResult (*mRoutine)(Caller, TInput);
+	size_t mStackSize;
+	FrameAllocator* mFrameAllocator;
 };
 
-template <class TTask, class TResult>
-class AwaiterCallbackUnsink: public AwaiterCallbackBase {
-public:
-	AwaiterCallbackUnsink(std::shared_ptr<WholeState<TResult>>, TaskAwaiter<TTask>*);
-	void operator()() override;
-	void operator()(void const*) override;
-private:
-	std::shared_ptr<WholeState<TResult>> mWholeState; // this AwaiterCallbackUnsink is inside the intermediate task and the WholeState holds the shared_ptr only to the main task - so no cyclic reference
-	TaskAwaiter<TTask> *mAwaiter;
-};
-
-template<class TPrevTask, class TResult>
-class AwaiterCallbackContinueWith : public AwaiterCallbackBase {
+template<class TPrevTask, class TResult, class F>
+class AwaiterCallbackContinueWith : public AwaiterCallbackBase { // allocated together with the task it resolves and the user's callable
 public:
-	AwaiterCallbackContinueWith(TPrevTask&, std::shared_ptr<Task<TResult>>, std::function<TResult(TPrevTask&)>);
-	void operator()() override;
+	AwaiterCallbackContinueWith(TPrevTask&, F&&);
+	static std::shared_ptr<Task<TResult>> start(TPrevTask&, F);
 private:
+	static void completed(AwaiterCallbackBase&);
+	static void abandoned(AwaiterCallbackBase&);
 	TPrevTask& mPrevTask;
-	std::shared_ptr<Task<TResult>> mNextTask;
-	std::function<TResult(TPrevTask&)> mFunc;
+	Task<TResult> mNextTask;
+	F mFunc;
+	std::shared_ptr<AwaiterCallbackContinueWith> mSelf; // keeps us (and the next task) alive until the previous task is completed or gone
 };
 
 // TEMPLATED MEMBERS DEFINITIONS
 template <class T>
-T TaskAwaiter<T>::getResult() {
-	std::unique_lock<std::mutex> lk(mMtx);
-	if (hasResult)
-		return *mResult;
-	else
-		if (mCompleted)
-			throw std::runtime_error("Trying to get the result of a task that ended with an exception.");
-		else
-			throw std::runtime_error("Trying to get the result of an unresolved task.");
+T const& TaskAwaiter<T>::getResult() {
+	if (!TaskAwaiterBase::isCompleted()) // this makes the result visible to us
+		throw std::runtime_error("Trying to get the result of an unresolved task.");
+	if (!hasResult)
+		TaskAwaiterBase::rethrowIfFailed();
+	return *mResult;
+}
+
+template <class T>
+T TaskAwaiter<T>::takeResult() {
+	return std::move(const_cast<T&>(getResult()));
 }
 
 template <class T>
@@ -141,19 +196,9 @@ T const* TaskAwaiter<T>::getResultPointer() {
 }
 
 template <class T>
-template<typename TResult>
-std::shared_ptr<Task<TResult>> Task<T>::continueWith(std::function<TResult(Task<T>&)> func) {
-	std::shared_ptr<Task<TResult>> spResult = std::make_shared<Task<TResult>>();
-	std::unique_lock<std::mutex> lk(TaskAwaiterBase::mMtx);
-	if (TaskAwaiterBase::mCompleted) {
-		TaskAwaiterBase::mMtx.unlock();
-		AwaiterCallbackContinueWith<Task<T>, TResult> callback(*this, spResult, func);
-		callback(); // this will throw only on an unrecoverable error
-	} else {
-		mContinueWithCallback = std::make_unique<AwaiterCallbackContinueWith<Task<T>, TResult>>(*this, spResult, func);
-		TaskAwaiterBase::mMtx.unlock();
-	}
-	return spResult;
+template <typename TResult, class F>
+std::shared_ptr<Task<typename ContinuationResult<TResult, F, Task<T>>::type>> Task<T>::continueWith(F func) {
+	return AwaiterCallbackContinueWith<Task<T>, typename ContinuationResult<TResult, F, Task<T>>::type, F>::start(*this, std::move(func));
 }
 
 template <class T>
@@ -161,142 +206,152 @@ TaskAwaiter<T> *Task<T>::getAwaiter() {
 	return static_cast<TaskAwaiter<T>*>(this);
 }
 
+// a task is resolved by one thread only: the checks below catch a second resolution made after the first one, not one racing with it
+template <class T>
+void Task<T>::setResult(T const& result) {
+	setResult(T(result));
+}
+
 template <class T>
-void Task<T>::setResult(T result) {
-	std::unique_lock<std::mutex> lk(TaskAwaiterBase::mMtx);
-	if (TaskAwaiterBase::mCompleted)
+void Task<T>::setResult(T&& result) {
+	resolve(std::move(result), this);
+}
+
+template <class T>
+void Task<T>::resolve(T&& result, void const* traceId) {
+	if (TaskAwaiterBase::isCompleted())
 		throw std::runtime_error("Trying to resolve a resolved or an erroneous task.");
-	TaskAwaiterBase::mCompleted = true;
 	new (TaskAwaiter<T>::mResult) T(std::move(result));
 	TaskAwaiter<T>::hasResult = true;
-	auto callback = std::move(TaskAwaiterBase::mOnCompletedCallback); // this way hypothetical immediate callback change won't cause errors
-	auto callbackFunc = std::move(mContinueWithCallback);
-	lk.unlock();
-	if (callback)
-		(*callback)(TaskAwaiter<T>::mResult);
-	cv.notify_all();
-	if (callbackFunc)
-		(*callbackFunc)();
+	AW_TRACE(resolved, traceId);
+	(void)traceId;
+	TaskAwaiterBase::complete(); // no lock, and no syscall unless somebody sleeps in the wait()
 	/* --- if anything above throws we consider it as an unrecoverable error --- */
 }
 
 template <class T>
-void Task<T>::setException(const std::exception& ex) {
-	std::unique_lock<std::mutex> lk(TaskAwaiterBase::mMtx); // won't throw if there's no invalid use of the lock ("The behavior is undefined if the current thread already owns the mutex except when the mutex is recursive.")
-	TaskAwaiterBase::mCompleted = true;
-	TaskAwaiterBase::setError(ex);
-	auto callback = std::move(TaskAwaiterBase::mOnCompletedCallback); // won't throw, AwaiterCallbackUnsink is known
-	lk.unlock(); // won't throw ("std::system_error is thrown if there is no associated mutex or if the mutex is not locked.")
-	/* --- nothing above can throw, though it doesn't really matter --- */
+void Task<T>::setException(std::exception_ptr error) {
+	fail(std::move(error), this);
+}
+
+template <class T>
+void Task<T>::fail(std::exception_ptr error, void const* traceId) {
+	if (TaskAwaiterBase::isCompleted())
+		throw std::runtime_error("Trying to resolve a resolved or an erroneous task.");
+	if (!error)
+		throw std::invalid_argument("Trying to resolve a task with a null exception_ptr.");
+	TaskAwaiterBase::setError(std::move(error));
+	AW_TRACE(failed, traceId);
+	(void)traceId;
 	/* --- if anything below throws we consider it as an unrecoverable error --- */
-	auto callbackFunc = std::move(mContinueWithCallback);
-	if (callback)
-		(*callback)(nullptr);
-	cv.notify_all();
-	if (callbackFunc)
-		(*callbackFunc)();
+	TaskAwaiterBase::complete();
+}
+
+template <class T>
+template <class TException>
+void Task<T>::setException(TException ex) {
+	static_assert(std::is_base_of<std::exception, TException>::value, "The exception should be of or derived from the std::exception type.");
+	setException(std::make_exception_ptr(std::move(ex))); // of the static type it's given with: pass the std::current_exception() from a catch clause instead so it isn't sliced
 }
 
 template <class T>
 void Task<T>::wait() {
-	std::unique_lock<std::mutex> lk(TaskAwaiterBase::mMtx);
-	if (TaskAwaiterBase::mCompleted) {
-		if (char const* what = TaskAwaiterBase::hasErrors())
-			throw Coroutine_error(what);
-		return;
-	}
-	cv.wait(lk, [this]{return this->mCompleted;}); // releases the lock and reacquires it upon return
-	if (char const* what = TaskAwaiterBase::hasErrors())
-		throw Coroutine_error(what);
+	TaskAwaiterBase::waitForCompletion();
+	TaskAwaiterBase::rethrowIfFailed();
 }
 
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
-Caller<TInput, TResult>::Caller(TResult (*f)(Caller, TInput)): mRoutine(f){}
+Caller<TInput, TResult>::Caller(TResult (*f)(Caller, TInput), size_t stackSize, FrameAllocator* pFrameAllocator): mRoutine(f), mStackSize(StackPool::stackSizeFor(stackSize)), mFrameAllocator(pFrameAllocator) {}
 
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
 std::shared_ptr<Task<TResult>> Caller<TInput, TResult>::operator()(TInput arg) {
-	mWholeState = std::make_shared<WholeState<TResult>>();
-	WholeState<TResult> *fromSink = firstLevel(&arg);
-	if (fromSink && !mWholeState->mState.sink_returnAddress) {
-		throw std::runtime_error("malloc did not succeed to allocate the stack.");
-	}
-
-	if (fromSink) { // didn't go synchronously (we're after the first call to the sink)
-		mWholeState->mTaskAwaiter->onCompleted(std::move(mWholeState->mTaskAwaiterCallback));
+	mWholeState = std::allocate_shared<WholeState<TResult>>(FrameAllocatorAdaptor<WholeState<TResult>>(mFrameAllocator ? *mFrameAllocator : FrameAllocator::defaultAllocator())); // the only allocation of the launch
+	StackState& rState = mWholeState->mState;
+	rState.stackSize = mStackSize;
+	rState.routine = reinterpret_cast<void (*)()>(mRoutine);
+	if (!acquireStack(rState))
+		throwNoStack("coroutine");
+
+	Launch launch{this, &arg, mWholeState.get()};
+	AW_TRACE(launched, mWholeState.get());
+	AW_STATS_COUNT(launched);
+	// save the current context and call the firstLevel() on the fresh stack. We'll be back here either from the first await() (the coroutine is suspended) or when the coroutine has ended (it went synchronously)
+	startContext(&rState.callerContext, reinterpret_cast<void*>(rState.stackStoragePointer + rState.stackSize), &Caller::firstLevel, &launch);
+	std::shared_ptr<WholeState<TResult>> spWholeState = std::move(mWholeState); // the coroutine has got its own copy of the Caller, we don't hold the task from now on
+
+	if (rState.finished)
+		releaseStack(rState);
+	else { // didn't go synchronously (we're after the first call to the sink)
+		if (spWholeState->mState.sharedStack)
+			saveSharedStack(spWholeState->mState); // before anybody can resume the coroutine
+		spWholeState->mTaskAwaiter->onCompleted(spWholeState->mTaskAwaiterCallback);
 		// if the callback will be executed right away and it will end with errors it will be like the coroutine has ended "synchronously". We will have two possibilities:
 		// 1. the continuation of the coroutine threw - this is just an equivalent of the synchronous case (do nothing)
 		// 2. or/and the setResult or the setException threw and we want it to propagate (the unrecoverable error):
 	}
-	if (mWholeState->isCaught) // only unrecoverable errors will be thrown from here. Exceptions from the coroutine will be thrown from the wait() call
-		throw std::runtime_error(mWholeState->caughtException);
+	if (spWholeState->mState.sharedStack)
+		releaseSharedStack(spWholeState->mState); // (after the onCompleted above) if the callback went right away it only queued the coroutine for the stack which it gets now
+	if (spWholeState->mCaughtException) // only unrecoverable errors will be thrown from here. Exceptions from the coroutine will be thrown from the wait() call
+		std::rethrow_exception(spWholeState->mCaughtException);
 
-	return atomic_load(&mWholeState->mTask); // we need an atomic operation here because at the same time the task can be resolved (so the shared_ptr needs to be dereferenced) in the secondLevel() by another thread running the above onCompleted callback ("If multiple threads of execution access the same std::shared_ptr object without synchronization and any of those accesses uses a non-const member function of shared_ptr then a data race will occur unless all such access is performed through these functions")
-	// NOTE: you cannot move atomically a shared shared_ptr so we have another copy from the atomic_load anyway (it will be "moved" since it's a temporary)
+	Task<TResult>* pTask = &spWholeState->mTask;
+	return std::shared_ptr<Task<TResult>>(std::move(spWholeState), pTask); // shares the ownership of the WholeState
 }
 
-// return address of this routine will be replaced by the saveandswitch_asm() and it'll point to cleanup_asm(). It will be used when user's routine will end (synchronously or asynchronously)
+// called by the startContext() on the new stack, nothing of the current frame is copied there. It never returns: when user's routine ends (synchronously or asynchronously) it leaves the stack for good switching to whoever has launched or resumed the coroutine
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
-WholeState<TResult> *Caller<TInput, TResult>::firstLevel(TInput *pArg) noexcept {
-	// return from the save_asm will be mimic by all the sink_asm() calls (in that case the returned value is set to true). The stack can be in a various state though
-	// save_asm saves its return address and the RBX, RBP, and the R12–R15 registers and sets the return value to false
-	int fromSink = saveandswitch_asm(mWholeState.get()); // save the registers and switch the stacks
-	if (fromSink == 2)
-		return mWholeState.get(); // Aaah, error! Serves as a flag
-
-	if (fromSink) {
-		// after first call to the sink() - stack is valid (switched back by the sink), return address is unchanged
-		return mWholeState.get(); // serves as a flag
-	}
-	// after actual call to the saveandswitch_asm(). We're on the alternative stack
-	WholeState<TResult> *pWholeState = mWholeState.get();
-	secondLevel(pArg, pWholeState);
-	// coroutine has ended, no valid "this" pointer from now on
-	return pWholeState; // this is so the cleanup_asm (synchronous or asynchronous return from the user's routine) has somehow got a reference to the original registers
+void Caller<TInput, TResult>::firstLevel(void* pLaunch) noexcept {
+	Launch* launch = static_cast<Launch*>(pLaunch);
+	WholeState<TResult>* pWholeState = launch->mWholeState;
+	launch->mCaller->secondLevel(launch->mArg, pWholeState);
+	// coroutine has ended, no valid mCaller pointer from now on
+	AW_TRACE(finished, pWholeState);
+	AW_STATS_COUNT(finished);
+	pWholeState->mState.finished = true; // this is so whoever we switch to knows the stack can be released
+	void* finishedContext;
+	switchContext(&finishedContext, pWholeState->mState.callerContext);
+	__builtin_unreachable();
 }
 
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
 void Caller<TInput, TResult>::secondLevel(TInput* pArg, WholeState<TResult>* pWholeState) noexcept {
-	std::shared_ptr<Task<TResult>> aspMainTask = std::atomic_load(&pWholeState->mTask); // noexcept; this effectively copies a shared_ptr (increments the use_count)
-	// "To avoid data races, once a shared pointer is passed to any of these functions, it cannot be accessed non-atomically. In particular, you cannot dereference such a shared_ptr without first atomically loading it into another shared_ptr object, and then dereferencing through the second object."
-	// NOTE: in our case it could be avoided by creating a separate shared_ptr for each thread but isn't it fun? :)
+	Task<TResult>& rMainTask = pWholeState->mTask; // whoever runs us holds the WholeState
 	try {
 		TResult result(mRoutine(*this, std::move(*pArg))); // if this throws it will be inside user's coroutine (either in user code or upon return - thanks to the copy elision). In that case we want to clean up and "rethrow" from the wait() or the await() (but not the caller() because we want uniform behaviour independently of whether the coroutine managed to return asynchronously or not)
 		// if the above mRoutine has returned asynchronously (we're not on the "main" thread) then the caller no longer exists - invalid "this" pointer and no access to the member variables
 		try {
-			aspMainTask->setResult(std::move(result)); // on the other hand if this throws we need to propagate it above our noexcept barrier
-		} catch (const std::exception& ex) {
-			pWholeState->isCaught = true;
-			copyNestedExceptionInfo(pWholeState->caughtException, ex, sizeof(WholeState<TResult>::caughtException));
+			rMainTask.resolve(std::move(result), pWholeState); // traced as the coroutine's; on the other hand if this throws we need to propagate it above our noexcept barrier
+		} catch (...) {
+			pWholeState->mCaughtException = std::current_exception();
 		}
-	} catch (const std::exception& ex) {
+	} catch (...) {
 		try {
-			aspMainTask->setException(ex); // same here if this throws we need to propagate it above our noexcept barrier
+			rMainTask.fail(std::current_exception(), pWholeState); // the original one, nothing is copied; same here if this throws we need to propagate it above our noexcept barrier
 			// if the mainTask is awaited then this will causes the await() to throw (on this very thread)
 			// if the mainTask is wait()-ed then this causes the wait() to throw (on another thread)
 			// if the coroutine went synchronously then this causes the caller() to throw
-		} catch (const std::exception& ex) {
-			pWholeState->isCaught = true;
-			copyNestedExceptionInfo(pWholeState->caughtException, ex, sizeof(WholeState<TResult>::caughtException));
+		} catch (...) {
+			pWholeState->mCaughtException = std::current_exception();
 		}
 	}
 
@@ -305,87 +360,260 @@ void Caller<TInput, TResult>::secondLevel(TInput* pArg, WholeState<TResult>* pWh
 
 #if __cpp_concepts >= 201507
 template <NonReference TInput, NonReference TResult>
-	requires CopyConstructible<TInput> && CopyConstructible<TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
 #else
 template <class TInput, class TResult>
 #endif
 template <typename TInterResult>
-TInterResult Caller<TInput, TResult>::await(Task<TInterResult> &rTask) {
+TInterResult const& Caller<TInput, TResult>::await(Task<TInterResult> &rTask) {
 	TaskAwaiter<TInterResult> *pAwaiter = rTask.getAwaiter();
 	mWholeState->mTaskAwaiter = pAwaiter;
 	if (pAwaiter->isCompleted()) {
-		if (char const* what = mWholeState->mTaskAwaiter->hasErrors())
-			throw Coroutine_error(what);
-		return pAwaiter->getResult();
+		AW_STATS_COUNT(awaitsCompleted);
+		pAwaiter->rethrowIfFailed();
+		return *pAwaiter->getResultPointer();
 	}
 
-	mWholeState->mTaskAwaiterCallback = std::make_unique<AwaiterCallbackUnsink<TInterResult, TResult>>(mWholeState, pAwaiter);
-	sink_asm(mWholeState.get()); // noexcept
-	// we're here only because the unsink_asm() has returned as the above sink_asm()
-
-	if (char const* what = mWholeState->mTaskAwaiter->hasErrors())
-		throw Coroutine_error(what);
+	suspendOn(pAwaiter, pAwaiter->getResultPointer());
+	mWholeState->mTaskAwaiter->rethrowIfFailed();
 
 	return *static_cast<TInterResult const*>(mWholeState->mResolvedValue);
 }
 
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+void Caller<TInput, TResult>::suspendOn(TaskAwaiterBase* pAwaiter, void const* pResult) {
+	mWholeState->mTaskAwaiter = pAwaiter;
+	mWholeState->mTaskAwaiterCallback.arm(mWholeState, pAwaiter, pResult); // registered with the task once we're off the coroutine's stack
+	AW_TRACE(suspended, mWholeState.get());
+	AW_STATS_COUNT(awaitsSuspended);
+#ifdef AW_STATS
+	uint64_t suspendedAt = Stats::now(); // kept on the coroutine's stack while it's suspended
+#endif
+	switchContext(&mWholeState->mState.coroutineContext, mWholeState->mState.callerContext); // noexcept; sink
+	// we're here only because the unsink() has switched back to us
+	AW_TRACE(resumed, mWholeState.get()); // possibly on another thread than the one we've suspended on
+#ifdef AW_STATS
+	Stats::record(StatsLatency::suspension, Stats::now() - suspendedAt);
+#endif
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult const& Caller<TInput, TResult>::await(Task<TInterResult>& rTask, std::chrono::nanoseconds timeout) {
+	if (!rTask.isCompleted() && !await(TimerWheel::defaultWheel().deadline(rTask, std::chrono::steady_clock::now() + timeout))) // suspends on the race of the task and the timer instead
+		throw std::system_error(std::make_error_code(std::errc::timed_out), "The awaited task has not been completed in time");
+	return await(rTask);
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult const& Caller<TInput, TResult>::await(Task<TInterResult>& rTask, CancellationToken const& rToken) {
+	rToken.throwIfCancelled();
+	if (!rTask.isCompleted() && rToken.canBeCancelled() && !await(rToken.guard(rTask))) // suspends on the race of the task and the token instead
+		rToken.throwIfCancelled();
+	return await(rTask);
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult Caller<TInput, TResult>::await(std::shared_ptr<Task<TInterResult>> const& spTask) {
+	return await(*spTask);
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult Caller<TInput, TResult>::await(std::shared_ptr<Task<TInterResult>>&& spTask) {
+	await(*spTask);
+	return spTask->takeResult(); // handed over to us
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult Caller<TInput, TResult>::await(std::shared_ptr<Task<TInterResult>> const& spTask, std::chrono::nanoseconds timeout) {
+	return await(*spTask, timeout);
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult Caller<TInput, TResult>::await(std::shared_ptr<Task<TInterResult>>&& spTask, std::chrono::nanoseconds timeout) {
+	await(*spTask, timeout);
+	return spTask->takeResult();
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult Caller<TInput, TResult>::await(std::shared_ptr<Task<TInterResult>> const& spTask, CancellationToken const& rToken) {
+	return await(*spTask, rToken);
+}
+
+#if __cpp_concepts >= 201507
+template <NonReference TInput, NonReference TResult>
+	requires MoveConstructible<TInput> && MoveConstructible<TResult>
+#else
+template <class TInput, class TResult>
+#endif
+template <typename TInterResult>
+TInterResult Caller<TInput, TResult>::await(std::shared_ptr<Task<TInterResult>>&& spTask, CancellationToken const& rToken) {
+	await(*spTask, rToken);
+	return spTask->takeResult();
+}
+
 template<typename TResult>
-void unsink(WholeState<TResult>& rWholeState, void const* pValue) {
-	rWholeState.mResolvedValue = pValue; // possibly nullptr
-	bool fromSink = unsink_asm(&rWholeState);
-
-	// we're here because the above unsink_asm saved its return address in the StackState.sink_returnAddress and:
-	// a. user's routine has ended and the cleanup_asm() has returned as the above unsink_asm()
-	// b. consecutive calls to the sink() has returned as it
-	if (fromSink) { // means no exceptions were intercepted
-		rWholeState.mTaskAwaiter->onCompleted(std::move(rWholeState.mTaskAwaiterCallback));
+void resumeOnStack(void* pWholeState) { // the stack of the coroutine is ours (it matters only for the shared stacks)
+	WholeState<TResult>& rWholeState = *static_cast<WholeState<TResult>*>(pWholeState);
+	if (rWholeState.mState.sharedStack)
+		restoreSharedStack(rWholeState.mState);
+	switchContext(&rWholeState.mState.callerContext, rWholeState.mState.coroutineContext);
+
+	// we're here because:
+	// a. user's routine has ended and the firstLevel() has switched back to us
+	// b. consecutive calls to the sink() has switched back to us
+	if (rWholeState.mState.finished)
+		releaseStack(rWholeState.mState);
+	else { // means no exceptions were intercepted
+		if (rWholeState.mState.sharedStack)
+			saveSharedStack(rWholeState.mState);
+		rWholeState.mTaskAwaiter->onCompleted(rWholeState.mTaskAwaiterCallback);
 		// if the callback will be executed right away and it will end with errors it will be like the coroutine has ended. We will have two possibilities:
 		// 1. the continuation of the coroutine threw - it doesn't propagate, we don't have to worry
 		// 2. or/and the setResult or the setException threw and we want it to propagate (the unrecoverable error):
 	}
+	if (rWholeState.mState.sharedStack)
+		releaseSharedStack(rWholeState.mState);
+
+	if (rWholeState.mCaughtException)
+		std::rethrow_exception(rWholeState.mCaughtException);
+}
+
+template<typename TResult>
+void resume(std::shared_ptr<WholeState<TResult>> const& spWholeState) {
+	if (spWholeState->mState.sharedStack && !acquireSharedStack(spWholeState->mState, &resumeOnStack<TResult>, spWholeState, spWholeState->mTaskAwaiter->getExecutor())) // the awaited task's executor, as the unsink() has chosen
+		return; // another coroutine runs on the shared stack, whoever releases it will resume ours
+	resumeOnStack<TResult>(spWholeState.get());
+}
+
+template<typename TResult>
+void resumeJob(void* pWholeState) { // posted to the executor or run on the trampoline by the unsink()
+	resume(static_cast<WholeState<TResult>*>(pWholeState)->shared_from_this());
+}
 
-	if (rWholeState.isCaught)
-		throw std::runtime_error(rWholeState.caughtException);
+template<typename TResult>
+void unsink(std::shared_ptr<WholeState<TResult>> const& spWholeState, void const* pValue, Executor* pExecutor) {
+	spWholeState->mResolvedValue = pValue;
+	AW_TRACE(woken, spWholeState.get());
+	if (pExecutor) {
+		pExecutor->post(&resumeJob<TResult>, spWholeState); // the thread resolving the task is free to go, unrecoverable errors end up in the executor's handler
+		return;
+	}
+	runTrampolined(&resumeJob<TResult>, spWholeState); // right away, unless we're being called from a coroutine resumed the same way (e.g. it has just ended resolving the task we've awaited): then right after it has switched back
 }
 
-template <class TTask, class TResult>
-AwaiterCallbackUnsink<TTask, TResult>::AwaiterCallbackUnsink(std::shared_ptr<WholeState<TResult>> spWholeState, TaskAwaiter<TTask>* pAwaiter) : mWholeState(spWholeState), mAwaiter(pAwaiter) {}
+template <class TResult>
+void AwaiterCallbackUnsink<TResult>::arm(std::shared_ptr<WholeState<TResult>> spWholeState, TaskAwaiterBase* pAwaiter, void const* pResult) {
+	mWholeState = std::move(spWholeState);
+	mAwaiter = pAwaiter;
+	mResult = pResult;
+}
 
-template <class TTask, class TResult>
-void AwaiterCallbackUnsink<TTask, TResult>::operator()(void const* pResult) {
-	unsink(*mWholeState.get(), pResult); // if this throws we consider it as an unrecoverable error
+template <class TResult>
+void AwaiterCallbackUnsink<TResult>::completed(AwaiterCallbackBase& rBase) { // whether the task has been completed right now or already was
+	AwaiterCallbackUnsink& rCallback = static_cast<AwaiterCallbackUnsink&>(rBase);
+	std::shared_ptr<WholeState<TResult>> spWholeState = std::move(rCallback.mWholeState); // the resumed coroutine may arm us again right away
+	unsink(spWholeState, rCallback.mResult, rCallback.mAwaiter->getExecutor()); // if this throws we consider it as an unrecoverable error
 }
 
-template <class TTask, class TResult>
-void AwaiterCallbackUnsink<TTask, TResult>::operator()() { // version for the "right away" execution
-	unsink(*mWholeState.get(), mAwaiter->getResultPointer()); // continuation
+template <class TResult>
+void AwaiterCallbackUnsink<TResult>::abandoned(AwaiterCallbackBase& rBase) {
+	AW_STATS_COUNT(abandoned);
+	std::shared_ptr<WholeState<TResult>> spWholeState = std::move(static_cast<AwaiterCallbackUnsink&>(rBase).mWholeState); // the coroutine will never be resumed. It isn't freed either: the Caller on its stack holds the WholeState as well, so the WholeState and the stack stay for good
 }
 
-template<class TPrevTask, class TResult>
-AwaiterCallbackContinueWith<TPrevTask, TResult>::AwaiterCallbackContinueWith(TPrevTask& prevTask, std::shared_ptr<Task<TResult>> nextTask, std::function<TResult(TPrevTask&)> func) : mPrevTask(prevTask), mNextTask(nextTask), mFunc(func) {}
+template<class TPrevTask, class TResult, class F>
+AwaiterCallbackContinueWith<TPrevTask, TResult, F>::AwaiterCallbackContinueWith(TPrevTask& prevTask, F&& func) : AwaiterCallbackBase(&completed, &abandoned), mPrevTask(prevTask), mFunc(std::move(func)) {}
 
-template<class TPrevTask, class TResult>
-void AwaiterCallbackContinueWith<TPrevTask, TResult>::operator()() {
+template<class TPrevTask, class TResult, class F>
+std::shared_ptr<Task<TResult>> AwaiterCallbackContinueWith<TPrevTask, TResult, F>::start(TPrevTask& prevTask, F func) {
+	std::shared_ptr<AwaiterCallbackContinueWith> spCallback = std::allocate_shared<AwaiterCallbackContinueWith>(FrameAllocatorAdaptor<AwaiterCallbackContinueWith>(FrameAllocator::defaultAllocator()), prevTask, std::move(func));
+	std::shared_ptr<Task<TResult>> spResult(spCallback, &spCallback->mNextTask);
+	spCallback->mSelf = spCallback;
+	prevTask.onCompleted(*spCallback); // if the task is completed this goes right away and will throw only on an unrecoverable error
+	return spResult;
+}
+
+template<class TPrevTask, class TResult, class F>
+void AwaiterCallbackContinueWith<TPrevTask, TResult, F>::completed(AwaiterCallbackBase& rBase) {
+	AwaiterCallbackContinueWith& rCallback = static_cast<AwaiterCallbackContinueWith&>(rBase);
+	std::shared_ptr<AwaiterCallbackContinueWith> spSelf = std::move(rCallback.mSelf); // whoever holds the next task keeps us alive from now on
+	AW_TRACE(continuationStarted, &rCallback);
 #if __cpp_lib_optional >= 201603
 	std::optional<TResult> result;
 	try {
-		result = mFunc(mPrevTask);
-	} catch (std::exception& ex) {
-		mNextTask->setException(ex);
+		result.emplace(rCallback.mFunc(rCallback.mPrevTask));
+		AW_TRACE(continuationFinished, &rCallback);
+	} catch (...) {
+		AW_TRACE(continuationFinished, &rCallback);
+		rCallback.mNextTask.setException(std::current_exception());
 		return;
 	}
-	mNextTask->setResult(result.value());
+	rCallback.mNextTask.setResult(std::move(result.value()));
 #else
 	alignas(TResult) char result[sizeof(TResult)]; // we cannot write TResult result; because it could not have the default ctor and...
 	try {
-		new (result) TResult(mFunc(mPrevTask)); // we need to distinguish if an exception was thrown by the continueWith callback or by the Task::setResult(). In the later case we want to let the exception freely propagate
-	} catch (std::exception& ex) {
-		mNextTask->setException(ex);
+		new (result) TResult(rCallback.mFunc(rCallback.mPrevTask)); // we need to distinguish if an exception was thrown by the continueWith callback or by the Task::setResult(). In the later case we want to let the exception freely propagate
+		AW_TRACE(continuationFinished, &rCallback);
+	} catch (...) {
+		AW_TRACE(continuationFinished, &rCallback);
+		rCallback.mNextTask.setException(std::current_exception());
 		return;
 	}
-	mNextTask->setResult(*reinterpret_cast<TResult*>(result));
+	rCallback.mNextTask.setResult(std::move(*reinterpret_cast<TResult*>(result)));
 	reinterpret_cast<TResult*>(result)->~TResult(); // standard: The notation for explicit call of a destructor can be used for any scalar type name. Allowing this makes it possible to write code without having to know if a destructor exists for a given type.
 #endif
 }
+
+template<class TPrevTask, class TResult, class F>
+void AwaiterCallbackContinueWith<TPrevTask, TResult, F>::abandoned(AwaiterCallbackBase& rBase) {
+	std::shared_ptr<AwaiterCallbackContinueWith> spSelf = std::move(static_cast<AwaiterCallbackContinueWith&>(rBase).mSelf); // the next task will never be resolved
+}
 }
 #endif
@@ -0,0 +1,75 @@
+#ifndef AW_TASKCOROTIMERS_H
+#define AW_TASKCOROTIMERS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "cancellation.h"
+#include "common.h"
+#include "executor.h"
+
+namespace aw_coroutines {
+template <class T>
+class Task;
+
+class Timer { // a node of the timer wheel, a part of whoever schedules it (like the AwaiterCallbackBase): neither scheduling nor cancelling allocates
+public:
+	typedef void (*Function)(Timer&, bool); // gets the derived object with a static_cast; true when the time is up, false when the wheel is being destroyed
+	explicit Timer(Function fire) : mFire(fire) {}
+	Timer(const Timer&) = delete;
+	Timer& operator=(const Timer&) = delete;
+private:
+	Function mFire; // called on the wheel's thread (it has to be short) when the timer is no longer scheduled, it may schedule it again
+	Timer* mNext = nullptr;
+	Timer** mLink = nullptr; // the pointer pointing at us (the slot or the previous timer), nullptr unless scheduled
+	uint64_t mTick = 0;
+friend class TimerWheel;
+};
+
+// A hierarchical timer wheel (4 levels of 256 slots, the finest one of the resolution given) on its own thread: scheduling and cancelling a timer is O(1) under a mutex, however many there are. The thread sleeps on a timerfd armed for the next tick with a slot to fire or to bring down to a lower level (the empty ones are skipped), not at all while the wheel is empty
+class TimerWheel {
+public:
+	explicit TimerWheel(std::chrono::nanoseconds resolution = std::chrono::milliseconds(1), Executor* = &Executor::defaultExecutor()); // the executor of the tasks it returns
+	~TimerWheel(); // the timers still scheduled are fired with false, must not be called from one of them
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	void schedule(Timer&, std::chrono::steady_clock::time_point); // rounded up to the resolution (a time already passed goes with the next tick); the timer mustn't be scheduled already
+	bool cancel(Timer&); // false if it isn't scheduled: it has been fired (or is being fired right now, then it must stay alive until its function has returned)
+
+	std::shared_ptr<Task<bool>> sleepAsync(std::chrono::nanoseconds, CancellationToken const& = CancellationToken()); // true once the time is up, false if the token is cancelled (or the wheel is destroyed) first
+	std::shared_ptr<Task<bool>> deadline(TaskAwaiterBase&, std::chrono::steady_clock::time_point); // true once the task is completed, false if the time is up first (the task goes on regardless); resumed on the task's executor
+
+	static TimerWheel& defaultWheel(); // of 1ms and the default executor, used by the Caller::await() with a timeout; it's never destroyed
+private:
+	struct Sleep;
+	struct Deadline;
+	static constexpr unsigned levels = 4;
+	static constexpr unsigned slotBits = 8;
+	static constexpr uint64_t slots = uint64_t(1) << slotBits;
+	uint64_t tickOf(std::chrono::steady_clock::time_point) const; // the first tick at or after the time
+	uint64_t place(Timer&); // into the slot of its tick, relative to the current one; the tick the slot is due at
+	uint64_t nextDue() const; // the first tick with a slot to fire or to bring down
+	void advance(); // to the next tick, the timers due go to the mDue
+	void arm(uint64_t); // the timerfd for the tick
+	void run();
+
+	std::chrono::steady_clock::time_point mStart; // of the tick 0
+	std::chrono::nanoseconds mResolution;
+	Executor* mExecutor;
+	int mTimerFd = -1;
+	std::mutex mMtx; // the slots, the counts and the ticks
+	Timer* mSlots[levels][slots] = {};
+	size_t mScheduled = 0;
+	uint64_t mCurrent = 0; // the last tick processed
+	uint64_t mArmed = UINT64_MAX; // the tick the timerfd is armed for, UINT64_MAX if disarmed
+	std::vector<Timer*> mDue; // taken off the wheel, fired once the mutex is released
+	bool mStopping = false;
+	std::thread mThread;
+};
+}
+#endif
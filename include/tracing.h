@@ -0,0 +1,47 @@
+#ifndef AW_TASKCOROTRACING_H
+#define AW_TASKCOROTRACING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+namespace aw_coroutines {
+// Lifecycle events of the coroutines and the tasks, recorded when the library and the code including the taskcoroutines.h are compiled with the AW_TRACING defined (the hooks are compiled out otherwise)
+enum class TraceEvent : uint8_t {
+	launched, // Caller::operator(), the coroutine starts running on this thread
+	suspended, // await() of a pending task, the coroutine switches out
+	woken, // the awaited task has been completed, the resumption is posted to the executor (or run right away)
+	resumed, // the coroutine runs again, on this thread
+	finished, // the coroutine has ended (with a result or an exception) and left its stack
+	resolved, // Task::setResult(), tagged with the coroutine for the task of a coroutine (when it ends) and with the task otherwise
+	failed, // Task::setException(), the same
+	continuationStarted, // the callback of a continueWith()
+	continuationFinished
+};
+
+// Every thread records into its own ring buffer (no locks, the oldest events are overwritten once it's full), tagged with the address of the coroutine's state (or of the task, or of the continuation) and the thread id
+class Tracer {
+public:
+	static void record(TraceEvent, void const*) noexcept;
+	static void setBufferSize(size_t); // events per thread (rounded up to a power of 2, 65536 by default), for the buffers of the threads which haven't recorded anything yet
+	static void exportChromeTrace(std::ostream&); // the Chrome trace event format (chrome://tracing, ui.perfetto.dev); the events being recorded meanwhile may be missed
+	static void clear(); // drops everything recorded so far; only while nothing is being recorded
+};
+}
+
+#ifdef AW_TRACING
+#define AW_TRACE(event, object) ::aw_coroutines::Tracer::record(::aw_coroutines::TraceEvent::event, object)
+#define AW_TRACING_SETTING libraryBuiltWithTracing
+#else
+#define AW_TRACE(event, object) ((void)0)
+#define AW_TRACING_SETTING libraryBuiltWithoutTracing
+#endif
+
+namespace aw_coroutines {
+// The hooks are in the templates and the inline functions, so every translation unit has to see the same setting (the root makefile's TRACE=1 builds the library with it). The library defines only the marker of its own setting: a translation unit compiled the other way is a link error instead of an ODR violation
+extern char const AW_TRACING_SETTING;
+namespace {
+__attribute__((used)) char const* const tracingSetting = &AW_TRACING_SETTING;
+}
+}
+#endif
@@ -0,0 +1,242 @@
+#ifndef AW_TASKCOROWHEN_H
+#define AW_TASKCOROWHEN_H
+
+#include <array>
+#include <atomic>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "taskcoroutines.h"
+
+namespace aw_coroutines {
+// Tasks completed when all (or any) of the given tasks are, so a coroutine awaiting N of them suspends only once:
+//	auto results = caller.await(whenAll(queryAsync(a), queryAsync(b))); // std::tuple<std::string, int>
+// The state holds the tasks and an intrusive callback for each of them, it lives until every one of them is completed. For the tasks given as arguments that's a single allocation, a range of them needs two more (the vector of the tasks and the array of the callbacks); the combined task is one allocation of its own, the coroutine awaiting it may move its result out
+// The whenAll() takes the results out of the tasks (so move-only ones work): it must be the only one getting them, others may still wait for the tasks
+
+template <class T>
+T taskResultOf(std::shared_ptr<Task<T>> const&); // only for the decltype
+
+template <class... T>
+std::shared_ptr<Task<std::tuple<T...>>> whenAll(std::shared_ptr<Task<T>>...); // ends with the first error (in the order of the tasks) if any of them has failed
+template <class TRange>
+auto whenAll(TRange const&) -> std::shared_ptr<Task<std::vector<decltype(taskResultOf(*std::begin(std::declval<TRange const&>())))>>>;
+template <class... T>
+std::shared_ptr<Task<size_t>> whenAny(std::shared_ptr<Task<T>>...); // the index of the task completed first (successfully or not)
+template <class TRange>
+auto whenAny(TRange const&) -> decltype(std::begin(std::declval<TRange const&>()), std::shared_ptr<Task<size_t>>());
+
+class WhenStateBase {
+public:
+	virtual ~WhenStateBase() = default;
+	virtual void completed(size_t) = 0; // called once for each of the tasks
+};
+
+class WhenCallback: public AwaiterCallbackBase {
+public:
+	WhenCallback() : AwaiterCallbackBase(&completed) {}
+	WhenStateBase* mState = nullptr;
+	size_t mIndex = 0;
+private:
+	static void completed(AwaiterCallbackBase& rBase) {
+		WhenCallback& rCallback = static_cast<WhenCallback&>(rBase);
+		rCallback.mState->completed(rCallback.mIndex);
+	}
+};
+
+template <class TTasks>
+struct WhenTasks { // how many tasks there are, where their callbacks live and how to go through them
+	typedef std::unique_ptr<WhenCallback[]> Callbacks; // the count is known only at run time
+	static size_t count(TTasks const& tasks) { return tasks.size(); }
+	static void allocate(Callbacks& callbacks, size_t count) { callbacks.reset(new WhenCallback[count]); }
+	template <class TState>
+	static void registerAll(TState& state) { state.registerAll(); }
+	template <class TState>
+	static void resolve(TState& state) { state.resolve(); }
+};
+
+template <class... T>
+struct WhenTasks<std::tuple<std::shared_ptr<Task<T>>...>> {
+	typedef std::array<WhenCallback, sizeof...(T)> Callbacks; // right in the state
+	static size_t count(std::tuple<std::shared_ptr<Task<T>>...> const&) { return sizeof...(T); }
+	static void allocate(Callbacks&, size_t) {}
+	template <class TState>
+	static void registerAll(TState& state) { state.registerAll(std::index_sequence_for<T...>()); }
+	template <class TState>
+	static void resolve(TState& state) { state.resolve(std::index_sequence_for<T...>()); }
+};
+
+template <class TTasks>
+class WhenState: public WhenStateBase {
+public:
+	WhenState(TTasks tasks, size_t count) : mTasks(std::move(tasks)), mRemaining(count) {
+		WhenTasks<TTasks>::allocate(mCallbacks, count);
+		for (size_t i = 0; i < count; ++i) {
+			mCallbacks[i].mState = this;
+			mCallbacks[i].mIndex = i;
+		}
+	}
+	template <class... TArgs>
+	void registerAll(TArgs... args) { registerCallbacks(mTasks, args...); }
+protected:
+	// the tasks are kept either in a tuple or in a vector
+	template <class... T, size_t... I>
+	void registerCallbacks(std::tuple<std::shared_ptr<Task<T>>...>& tasks, std::index_sequence<I...>) {
+		int expand[] = {0, (std::get<I>(tasks)->onCompleted(mCallbacks[I]), 0)...};
+		(void)expand;
+	}
+	template <class T>
+	void registerCallbacks(std::vector<std::shared_ptr<Task<T>>>& tasks) {
+		for (size_t i = 0; i < tasks.size(); ++i)
+			tasks[i]->onCompleted(mCallbacks[i]);
+	}
+	bool countDown() { // true for the last one; acquires the results of all the tasks
+		return mRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+	}
+
+	TTasks mTasks;
+	typename WhenTasks<TTasks>::Callbacks mCallbacks;
+	std::atomic<size_t> mRemaining;
+	std::shared_ptr<WhenState> mSelf; // released when the last task is completed
+};
+
+template <class TResult, class TTasks>
+class WhenAllState: public WhenState<TTasks> {
+public:
+	using WhenState<TTasks>::WhenState;
+	static std::shared_ptr<Task<TResult>> start(TTasks);
+	void completed(size_t) override;
+	template <class... TArgs>
+	void resolve(TArgs...);
+private:
+	template <class... T, size_t... I>
+	static std::exception_ptr firstError(std::tuple<std::shared_ptr<Task<T>>...>& tasks, std::index_sequence<I...>) {
+		std::exception_ptr errors[] = {nullptr, std::get<I>(tasks)->getException()...};
+		for (std::exception_ptr& error : errors)
+			if (error)
+				return error;
+		return nullptr;
+	}
+	template <class T>
+	static std::exception_ptr firstError(std::vector<std::shared_ptr<Task<T>>>& tasks) {
+		for (auto& spTask : tasks)
+			if (std::exception_ptr error = spTask->getException())
+				return error;
+		return nullptr;
+	}
+	template <class... T, size_t... I>
+	static std::tuple<T...> results(std::tuple<std::shared_ptr<Task<T>>...>& tasks, std::index_sequence<I...>) {
+		return std::tuple<T...>(std::get<I>(tasks)->takeResult()...);
+	}
+	template <class T>
+	static std::vector<T> results(std::vector<std::shared_ptr<Task<T>>>& tasks) {
+		std::vector<T> values;
+		values.reserve(tasks.size());
+		for (auto& spTask : tasks)
+			values.push_back(spTask->takeResult());
+		return values;
+	}
+	std::shared_ptr<Task<TResult>> mResult = std::make_shared<Task<TResult>>();
+};
+
+template <class TTasks>
+class WhenAnyState: public WhenState<TTasks> {
+public:
+	using WhenState<TTasks>::WhenState;
+	static std::shared_ptr<Task<size_t>> start(TTasks);
+	void completed(size_t) override;
+private:
+	std::shared_ptr<Task<size_t>> mResult = std::make_shared<Task<size_t>>();
+	std::atomic<bool> mDone{false};
+};
+
+// TEMPLATED MEMBERS DEFINITIONS
+template <class TResult, class TTasks>
+std::shared_ptr<Task<TResult>> WhenAllState<TResult, TTasks>::start(TTasks tasks) {
+	size_t count = WhenTasks<TTasks>::count(tasks);
+	auto spState = std::make_shared<WhenAllState>(std::move(tasks), count);
+	std::shared_ptr<Task<TResult>> spResult = spState->mResult;
+	if (!count) {
+		WhenTasks<TTasks>::resolve(*spState);
+		return spResult;
+	}
+	spState->mSelf = spState;
+	WhenTasks<TTasks>::registerAll(*spState); // the tasks already completed count down right away
+	return spResult;
+}
+
+template <class TResult, class TTasks>
+void WhenAllState<TResult, TTasks>::completed(size_t) {
+	if (!this->countDown())
+		return;
+	std::shared_ptr<WhenState<TTasks>> spSelf = std::move(this->mSelf); // we go away with the last callback
+	WhenTasks<TTasks>::resolve(*this); // right here, whoever has completed the last task doesn't read its result any more
+}
+
+template <class TResult, class TTasks>
+template <class... TArgs>
+void WhenAllState<TResult, TTasks>::resolve(TArgs... args) {
+	if (std::exception_ptr error = firstError(this->mTasks, args...)) {
+		mResult->setException(std::move(error)); // the original one
+		return;
+	}
+	bool taken = false;
+	try {
+		TResult values(results(this->mTasks, args...));
+		taken = true;
+		mResult->setResult(std::move(values));
+	} catch (...) {
+		if (taken) // the setResult() has failed, that's an unrecoverable error
+			throw;
+		mResult->setException(std::current_exception());
+	}
+}
+
+template <class TTasks>
+std::shared_ptr<Task<size_t>> WhenAnyState<TTasks>::start(TTasks tasks) {
+	size_t count = WhenTasks<TTasks>::count(tasks);
+	if (!count)
+		throw std::invalid_argument("whenAny() needs at least one task.");
+	auto spState = std::make_shared<WhenAnyState>(std::move(tasks), count);
+	std::shared_ptr<Task<size_t>> spResult = spState->mResult;
+	spState->mSelf = spState;
+	WhenTasks<TTasks>::registerAll(*spState);
+	return spResult;
+}
+
+template <class TTasks>
+void WhenAnyState<TTasks>::completed(size_t index) {
+	if (!mDone.exchange(true, std::memory_order_acq_rel))
+		mResult->setResult(index); // the rest of the callbacks only count down
+	if (this->countDown()) {
+		std::shared_ptr<WhenState<TTasks>> spSelf = std::move(this->mSelf); // we go away with the last callback
+	}
+}
+
+template <class... T>
+std::shared_ptr<Task<std::tuple<T...>>> whenAll(std::shared_ptr<Task<T>>... tasks) {
+	typedef std::tuple<std::shared_ptr<Task<T>>...> Tasks;
+	return WhenAllState<std::tuple<T...>, Tasks>::start(Tasks(std::move(tasks)...));
+}
+
+template <class TRange>
+auto whenAll(TRange const& range) -> std::shared_ptr<Task<std::vector<decltype(taskResultOf(*std::begin(std::declval<TRange const&>())))>>> {
+	typedef decltype(taskResultOf(*std::begin(range))) T;
+	return WhenAllState<std::vector<T>, std::vector<std::shared_ptr<Task<T>>>>::start(std::vector<std::shared_ptr<Task<T>>>(std::begin(range), std::end(range)));
+}
+
+template <class... T>
+std::shared_ptr<Task<size_t>> whenAny(std::shared_ptr<Task<T>>... tasks) {
+	typedef std::tuple<std::shared_ptr<Task<T>>...> Tasks;
+	return WhenAnyState<Tasks>::start(Tasks(std::move(tasks)...));
+}
+
+template <class TRange>
+auto whenAny(TRange const& range) -> decltype(std::begin(std::declval<TRange const&>()), std::shared_ptr<Task<size_t>>()) {
+	typedef decltype(taskResultOf(*std::begin(range))) T;
+	return WhenAnyState<std::vector<std::shared_ptr<Task<T>>>>::start(std::vector<std::shared_ptr<Task<T>>>(std::begin(range), std::end(range)));
+}
+}
+#endif
@@ -0,0 +1,176 @@
+#include "cancellation.h"
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include "taskcoroutines.h"
+
+namespace aw_coroutines {
+namespace {
+struct Guard: AwaiterCallbackBase, CancellationCallback { // the task and the token race to resolve the result, whoever comes second only lets go of us
+	explicit Guard(CancellationToken const& rToken) : AwaiterCallbackBase(&completed, &abandoned), CancellationCallback(&cancelled), token(rToken) {}
+	CancellationToken token;
+	Task<bool> task;
+	std::atomic<bool> decided{false};
+	std::shared_ptr<Guard> heldByTask; // until the task is completed (or gone)
+	std::shared_ptr<Guard> heldByToken; // until the callback is called or unsubscribed
+
+	static void completed(AwaiterCallbackBase& rBase) {
+		Guard& rGuard = static_cast<Guard&>(rBase);
+		std::shared_ptr<Guard> spSelf = std::move(rGuard.heldByTask);
+		if (rGuard.decided.exchange(true))
+			return;
+		if (rGuard.token.unsubscribe(rGuard)) // otherwise it's being called right now and lets go of us itself
+			rGuard.heldByToken.reset();
+		rGuard.task.setResult(true);
+	}
+	static void abandoned(AwaiterCallbackBase& rBase) { // the task will never be completed, neither will ours: it's abandoned in turn once nobody holds it
+		Guard& rGuard = static_cast<Guard&>(rBase);
+		std::shared_ptr<Guard> spSelf = std::move(rGuard.heldByTask);
+		if (rGuard.token.unsubscribe(rGuard)) // the token would keep us until it's cancelled, which may never happen
+			rGuard.heldByToken.reset();
+	}
+	static void cancelled(CancellationCallback& rCallback) {
+		Guard& rGuard = static_cast<Guard&>(rCallback);
+		std::shared_ptr<Guard> spSelf = std::move(rGuard.heldByToken);
+		if (!rGuard.decided.exchange(true))
+			rGuard.task.setResult(false);
+	}
+};
+}
+
+struct CancellationToken::State {
+	~State();
+	bool cancel();
+	std::atomic<bool> cancelled{false};
+	std::mutex mtx; // the list, the callbacks are called without it
+	CancellationCallback* head = nullptr;
+	CancellationToken parent;
+	std::shared_ptr<Link> spLink; // registered with the parent
+};
+
+struct CancellationToken::Link: CancellationCallback { // cancels a child source with its parent; the child may be gone by then
+	explicit Link(std::shared_ptr<State> const& spChild) : CancellationCallback(&cancelled), wpChild(spChild) {}
+	std::weak_ptr<State> wpChild;
+	std::shared_ptr<Link> self; // while it's registered
+
+	static void cancelled(CancellationCallback& rCallback) {
+		Link& rLink = static_cast<Link&>(rCallback);
+		std::shared_ptr<Link> spSelf = std::move(rLink.self);
+		if (std::shared_ptr<State> spChild = rLink.wpChild.lock())
+			spChild->cancel();
+	}
+};
+
+CancellationToken::State::~State() {
+	if (spLink && parent.unsubscribe(*spLink))
+		spLink->self.reset();
+}
+
+bool CancellationToken::State::cancel() {
+	std::unique_lock<std::mutex> lk(mtx);
+	if (cancelled.load(std::memory_order_relaxed))
+		return false;
+	cancelled.store(true, std::memory_order_release);
+	while (CancellationCallback* pCallback = head) { // whoever unsubscribes meanwhile finds its callback called already
+		head = pCallback->mNext;
+		if (pCallback->mNext)
+			pCallback->mNext->mLink = &head;
+		pCallback->mLink = nullptr;
+		lk.unlock();
+		pCallback->mCancelled(*pCallback);
+		lk.lock();
+	}
+	return true;
+}
+
+CancellationToken::CancellationToken(std::shared_ptr<State> spState) : mState(std::move(spState)) {}
+
+bool CancellationToken::isCancelled() const {
+	return mState && mState->cancelled.load(std::memory_order_acquire);
+}
+
+bool CancellationToken::canBeCancelled() const {
+	return static_cast<bool>(mState);
+}
+
+void CancellationToken::throwIfCancelled() const {
+	if (isCancelled())
+		throw std::system_error(std::make_error_code(std::errc::operation_canceled), "The operation has been cancelled");
+}
+
+bool CancellationToken::subscribe(CancellationCallback& rCallback) const {
+	if (!mState)
+		return false;
+	std::unique_lock<std::mutex> lk(mState->mtx);
+	if (mState->cancelled.load(std::memory_order_relaxed))
+		return false;
+	if (rCallback.mLink)
+		throw std::logic_error("The callback is registered already.");
+	rCallback.mNext = mState->head;
+	if (mState->head)
+		mState->head->mLink = &rCallback.mNext;
+	mState->head = &rCallback;
+	rCallback.mLink = &mState->head;
+	return true;
+}
+
+bool CancellationToken::unsubscribe(CancellationCallback& rCallback) const {
+	if (!mState)
+		return false;
+	std::unique_lock<std::mutex> lk(mState->mtx);
+	if (!rCallback.mLink)
+		return false;
+	*rCallback.mLink = rCallback.mNext;
+	if (rCallback.mNext)
+		rCallback.mNext->mLink = rCallback.mLink;
+	rCallback.mLink = nullptr;
+	return true;
+}
+
+std::shared_ptr<Task<bool>> CancellationToken::guard(TaskAwaiterBase& rTask) const {
+	std::shared_ptr<Guard> spGuard = std::allocate_shared<Guard>(FrameAllocatorAdaptor<Guard>(FrameAllocator::defaultAllocator()), *this);
+	spGuard->task.setExecutor(rTask.getExecutor());
+	std::shared_ptr<Task<bool>> spResult(spGuard, &spGuard->task);
+	spGuard->heldByToken = spGuard;
+	if (!subscribe(*spGuard)) {
+		spGuard->heldByToken.reset();
+		if (isCancelled()) {
+			spGuard->decided.store(true);
+			spGuard->task.setResult(false);
+			return spResult;
+		}
+	}
+	spGuard->heldByTask = spGuard;
+	rTask.onCompleted(*spGuard); // if the task is completed this goes right away
+	return spResult;
+}
+
+CancellationSource::CancellationSource() : mState(std::make_shared<CancellationToken::State>()) {}
+
+CancellationSource::CancellationSource(CancellationToken const& rParent) : CancellationSource() {
+	if (!rParent.canBeCancelled())
+		return;
+	mState->parent = rParent;
+	mState->spLink = std::make_shared<CancellationToken::Link>(mState);
+	mState->spLink->self = mState->spLink;
+	if (!rParent.subscribe(*mState->spLink)) { // cancelled already
+		mState->spLink->self.reset();
+		mState->spLink.reset();
+		mState->cancel();
+	}
+}
+
+CancellationToken CancellationSource::token() const {
+	return CancellationToken(mState);
+}
+
+bool CancellationSource::cancel() {
+	return mState->cancel();
+}
+
+bool CancellationSource::isCancelled() const {
+	return mState->cancelled.load(std::memory_order_acquire);
+}
+}
@@ -0,0 +1,175 @@
+#include "executor.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace aw_coroutines {
+namespace {
+thread_local Executor const* currentExecutor = nullptr;
+thread_local size_t currentWorker = 0;
+}
+
+namespace {
+class JobRing { // a deque which doesn't allocate once it has grown to the size it needs (std::deque allocates and frees its blocks as the jobs go through)
+public:
+	bool empty() const { return mHead == mTail; }
+	void pushBack(Executor::Job&& job) {
+		if (mTail - mHead == mJobs.size())
+			grow();
+		mJobs[mTail++ & (mJobs.size() - 1)] = std::move(job);
+	}
+	Executor::Job popBack() { return std::move(mJobs[--mTail & (mJobs.size() - 1)]); }
+	Executor::Job popFront() { return std::move(mJobs[mHead++ & (mJobs.size() - 1)]); }
+private:
+	void grow() {
+		std::vector<Executor::Job> jobs(mJobs.empty() ? 64 : mJobs.size() * 2);
+		for (size_t i = 0; mHead != mTail; ++i)
+			jobs[i] = popFront();
+		mTail = mJobs.size();
+		mHead = 0;
+		mJobs.swap(jobs);
+	}
+	std::vector<Executor::Job> mJobs; // the size is a power of 2
+	size_t mHead = 0;
+	size_t mTail = 0;
+};
+}
+
+namespace {
+thread_local bool trampolineRunning = false;
+thread_local JobRing trampolineJobs;
+}
+
+struct Executor::Worker {
+	std::mutex mtx;
+	JobRing jobs;
+	std::thread thread;
+};
+
+Executor::Executor(size_t workers) : mCount(workers ? workers : std::max(1u, std::thread::hardware_concurrency())) {
+	mWorkers.reset(new Worker[mCount]);
+}
+
+Executor::~Executor() {
+	{
+		std::unique_lock<std::mutex> lk(mIdleMtx);
+		mStop = true;
+	}
+	mIdleCv.notify_all();
+	for (size_t i = 0; i < mCount; ++i)
+		if (mWorkers[i].thread.joinable())
+			mWorkers[i].thread.join();
+}
+
+void Executor::post(void (*function)(void*), std::shared_ptr<void> spArg) {
+	std::call_once(mStarted, &Executor::start, this);
+	Worker& worker = mWorkers[runsOnWorker() ? currentWorker : mNext.fetch_add(1, std::memory_order_relaxed) % mCount];
+	{
+		std::unique_lock<std::mutex> lk(worker.mtx);
+		worker.jobs.pushBack(Job(function, std::move(spArg)));
+	}
+	mQueued.fetch_add(1); // sequentially consistent with the mSleeping below (and the other way around in the work()) so either we see the sleeping worker or it sees our job
+	if (mSleeping.load()) {
+		std::unique_lock<std::mutex> lk(mIdleMtx); // the worker is either waiting already or will check the mQueued before it does
+		lk.unlock();
+		mIdleCv.notify_one();
+	}
+}
+
+size_t Executor::workers() const {
+	return mCount;
+}
+
+bool Executor::runsOnWorker() const {
+	return currentExecutor == this;
+}
+
+void Executor::setUnhandledExceptionHandler(void (*handler)(std::exception_ptr)) {
+	mHandler.store(handler);
+}
+
+Executor& Executor::defaultExecutor() {
+	static Executor* executor = new Executor(); // leaked on purpose: coroutines may still be resumed while the static objects are being destroyed
+	return *executor;
+}
+
+void Executor::start() {
+	for (size_t i = 0; i < mCount; ++i)
+		mWorkers[i].thread = std::thread(&Executor::work, this, i);
+}
+
+void Executor::work(size_t index) {
+	currentExecutor = this;
+	currentWorker = index;
+	Job job;
+	while (true) {
+		if (take(index, job)) {
+			try {
+				job.first(job.second.get());
+			} catch (...) {
+				void (*handler)(std::exception_ptr) = mHandler.load();
+				if (!handler)
+					std::terminate();
+				handler(std::current_exception());
+			}
+			job.second.reset();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lk(mIdleMtx);
+		mSleeping.fetch_add(1);
+		mIdleCv.wait(lk, [this]{ return mQueued.load() || mStop; });
+		mSleeping.fetch_sub(1);
+		if (mStop && !mQueued.load())
+			return;
+	}
+}
+
+bool Executor::take(size_t index, Job& job) { // the back of our own deque or the front of somebody else's
+	for (size_t i = 0; i < mCount; ++i) {
+		Worker& worker = mWorkers[(index + i) % mCount];
+		std::unique_lock<std::mutex> lk(worker.mtx);
+		if (worker.jobs.empty())
+			continue;
+		job = i ? worker.jobs.popFront() : worker.jobs.popBack();
+		lk.unlock();
+		mQueued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void runTrampolined(void (*function)(void*), std::shared_ptr<void> spArg) {
+	if (trampolineRunning) { // we're called from inside the function the outermost call runs, which will get to us once it's returned
+		trampolineJobs.pushBack(Executor::Job(function, std::move(spArg)));
+		return;
+	}
+	trampolineRunning = true;
+	std::exception_ptr firstException;
+	Executor::Job job(function, std::move(spArg));
+	while (true) {
+		try {
+			job.first(job.second.get());
+		} catch (...) { // the rest of the queue still has to go, nobody else would run it
+			if (!firstException)
+				firstException = std::current_exception();
+		}
+		job.second.reset();
+		if (trampolineJobs.empty())
+			break;
+		job = trampolineJobs.popFront();
+	}
+	trampolineRunning = false;
+	if (firstException)
+		std::rethrow_exception(firstException);
+}
+
+void handOffTrampolined() {
+	if (!trampolineRunning)
+		return;
+	while (!trampolineJobs.empty()) {
+		Executor::Job job = trampolineJobs.popFront();
+		Executor::defaultExecutor().post(job.first, std::move(job.second));
+	}
+}
+}
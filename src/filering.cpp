@@ -0,0 +1,467 @@
+#include "filering.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace aw_coroutines {
+namespace {
+uint64_t const stopMarker = ~uint64_t(0); // the user_data of the NOP that stops the completion thread
+uint64_t const cancelMarker = ~uint64_t(1); // of the cancellations, any other is a slot (in the lower half)
+size_t const maxLength = 0x7ffff000; // the most a single read() or write() transfers on Linux (the length in the SQE is 32 bits anyway)
+
+thread_local FileRing* currentBatch = nullptr;
+
+template <class T>
+void resolve(std::shared_ptr<void> const& spTask, long result, int error) {
+	Task<T>& rTask = *static_cast<Task<T>*>(spTask.get());
+	if (error)
+		rTask.setException(std::system_error(error, std::generic_category()));
+	else
+		rTask.setResult(static_cast<T>(result));
+}
+
+struct BlockingOperation { // for the fallback threads
+	uint8_t opcode;
+	int fd;
+	char* buffer;
+	size_t size;
+	uint64_t offset;
+	uint32_t flags;
+	void (*resolve)(std::shared_ptr<void> const&, long, int);
+	std::shared_ptr<void> spTask;
+	CancellationToken token;
+};
+
+void runBlocking(void* pOperation) {
+	BlockingOperation& rOperation = *static_cast<BlockingOperation*>(pOperation);
+	if (rOperation.token.isCancelled()) {
+		rOperation.resolve(rOperation.spTask, 0, ECANCELED);
+		return;
+	}
+	long result;
+	do {
+		switch (rOperation.opcode) {
+		case IORING_OP_READ:
+			result = pread(rOperation.fd, rOperation.buffer, rOperation.size, rOperation.offset);
+			break;
+		case IORING_OP_WRITE:
+			result = pwrite(rOperation.fd, rOperation.buffer, rOperation.size, rOperation.offset);
+			break;
+		default:
+			result = rOperation.flags & IORING_FSYNC_DATASYNC ? fdatasync(rOperation.fd) : fsync(rOperation.fd);
+		}
+	} while (result < 0 && errno == EINTR);
+	rOperation.resolve(rOperation.spTask, result < 0 ? 0 : result, result < 0 ? errno : 0);
+}
+
+int ioUringSetup(unsigned entries, io_uring_params* pParams) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, pParams));
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int ioUringRegister(int fd, unsigned opcode, void const* pArg, unsigned count) {
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, pArg, count));
+}
+
+template <class T>
+T* at(void* pBase, unsigned offset) {
+	return reinterpret_cast<T*>(static_cast<char*>(pBase) + offset);
+}
+}
+
+struct FileRing::Cancel: CancellationCallback { // registered with the token of an operation in flight
+	Cancel(FileRing& rRing, uint64_t userData, CancellationToken const& rToken, std::shared_ptr<void> const& spTask) : CancellationCallback(&cancelled), ring(rRing), userData(userData), token(rToken), wpTask(spTask) {}
+	FileRing& ring;
+	uint64_t userData;
+	CancellationToken token;
+	std::weak_ptr<void> wpTask;
+	std::shared_ptr<Cancel> self; // while we're subscribed
+
+	void release() { // the operation is done
+		if (token.unsubscribe(*this)) // otherwise it's being called right now, finds the operation gone and lets go of itself
+			self.reset();
+	}
+	static void cancelled(CancellationCallback& rCallback) {
+		Cancel& rCancel = static_cast<Cancel&>(rCallback);
+		std::shared_ptr<Cancel> spSelf = std::move(rCancel.self);
+		std::shared_ptr<void> spTask = rCancel.wpTask.lock();
+		if (!spTask)
+			return;
+		FileRing& rRing = rCancel.ring;
+		void (*resolve)(std::shared_ptr<void> const&, long, int) = nullptr;
+		{
+			std::unique_lock<std::mutex> lk(rRing.mSqMtx);
+			unsigned slot = static_cast<unsigned>(rCancel.userData & 0xffffffff);
+			Slot& rSlot = rRing.mSlots[slot];
+			if (rRing.mStopping || rSlot.spTask != spTask) // done already
+				return;
+			if (rRing.unqueue(rCancel.userData)) { // the kernel hasn't seen it, so it ends right here
+				resolve = rSlot.resolve;
+				rSlot.spTask.reset();
+				rSlot.spCancel.reset();
+				rRing.mFreeSlots.push_back(slot);
+			} else
+				rRing.queueCancel(rCancel.userData);
+		}
+		if (resolve)
+			resolve(spTask, 0, ECANCELED);
+		else
+			rRing.submit();
+	}
+};
+
+struct FileRing::Fallback {
+	Executor threads{4}; // blocked in the syscalls, not resuming anything (the tasks have their own executor)
+};
+
+struct FileRing::Queue {
+	std::deque<io_uring_sqe> entries;
+};
+
+FileRing::FileRing(unsigned entries, Executor* pExecutor) : mExecutor(pExecutor) {
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	mRingFd = ioUringSetup(entries ? entries : 1, &params);
+	if (mRingFd < 0 || !(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_RW_CUR_POS)) { // no io_uring or one older than 5.6 (no IORING_OP_READ and IORING_OP_WRITE)
+		if (mRingFd >= 0)
+			close(mRingFd);
+		mRingFd = -1;
+		mFallback.reset(new Fallback());
+		return;
+	}
+
+	mEntries = params.sq_entries;
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMapping = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMapping)
+		mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+	mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+	mCqRing = singleMapping ? mSqRing : mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+	mSqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+	if (mSqRing == MAP_FAILED || mCqRing == MAP_FAILED || mSqes == MAP_FAILED) {
+		int error = errno;
+		if (mSqes != MAP_FAILED)
+			munmap(mSqes, mSqesSize);
+		if (mCqRing != MAP_FAILED && !singleMapping)
+			munmap(mCqRing, mCqRingSize);
+		if (mSqRing != MAP_FAILED)
+			munmap(mSqRing, mSqRingSize);
+		close(mRingFd);
+		throw std::system_error(error, std::generic_category(), "Could not map the io_uring");
+	}
+	mSqHead = at<unsigned>(mSqRing, params.sq_off.head);
+	mSqTail = at<unsigned>(mSqRing, params.sq_off.tail);
+	mSqMask = at<unsigned>(mSqRing, params.sq_off.ring_mask);
+	mSqArray = at<unsigned>(mSqRing, params.sq_off.array);
+	mCqHead = at<unsigned>(mCqRing, params.cq_off.head);
+	mCqTail = at<unsigned>(mCqRing, params.cq_off.tail);
+	mCqMask = at<unsigned>(mCqRing, params.cq_off.ring_mask);
+	mCqes = at<void>(mCqRing, params.cq_off.cqes);
+	mCqEntries = params.cq_entries;
+	mSlots.reserve(params.cq_entries);
+	mQueue.reset(new Queue());
+	mCompletionThread = std::thread(&FileRing::complete, this);
+}
+
+FileRing::~FileRing() {
+	if (mFallback) {
+		mFallback.reset(); // runs whatever is queued and joins the threads
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lk(mSqMtx);
+		mStopping = true;
+		io_uring_sqe sqe;
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_NOP;
+		sqe.user_data = stopMarker;
+		queueSqe(sqe); // after whatever is queued, so the completion thread sees it last
+	}
+	submit();
+	mCompletionThread.join();
+	munmap(mSqes, mSqesSize);
+	if (mCqRing != mSqRing)
+		munmap(mCqRing, mCqRingSize);
+	munmap(mSqRing, mSqRingSize);
+	close(mRingFd);
+}
+
+template <class T>
+std::shared_ptr<Task<T>> FileRing::start(uint8_t opcode, int fd, char* buffer, size_t size, uint64_t offset, uint32_t flags, CancellationToken const& rToken) {
+	std::shared_ptr<Task<T>> spTask = std::make_shared<Task<T>>();
+	spTask->setExecutor(mExecutor);
+	size = std::min(size, maxLength);
+	if (rToken.isCancelled()) {
+		resolve<T>(spTask, 0, ECANCELED);
+		return spTask;
+	}
+	if (mFallback) {
+		mFallback->threads.post(&runBlocking, std::make_shared<BlockingOperation>(BlockingOperation{opcode, fd, buffer, size, offset, flags, &resolve<T>, spTask, rToken}));
+		return spTask;
+	}
+
+	std::unique_lock<std::mutex> lk(mSqMtx);
+	if (mStopping) {
+		lk.unlock();
+		resolve<T>(spTask, 0, ECANCELED);
+		return spTask;
+	}
+	unsigned slot;
+	if (mFreeSlots.empty()) {
+		slot = static_cast<unsigned>(mSlots.size());
+		mSlots.push_back(Slot{&resolve<T>, spTask, nullptr, 0});
+	} else {
+		slot = mFreeSlots.back();
+		mFreeSlots.pop_back();
+		mSlots[slot].resolve = &resolve<T>;
+		mSlots[slot].spTask = spTask;
+		++mSlots[slot].generation;
+	}
+	uint64_t userData = uint64_t(mSlots[slot].generation) << 32 | slot;
+
+	io_uring_sqe sqe;
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	sqe.addr = reinterpret_cast<uintptr_t>(buffer);
+	sqe.len = static_cast<uint32_t>(size);
+	sqe.off = offset;
+	sqe.user_data = userData;
+	if (opcode == IORING_OP_FSYNC)
+		sqe.fsync_flags = flags;
+	if (static_cast<size_t>(fd) < mFileIndexes.size() && mFileIndexes[fd] >= 0) {
+		sqe.fd = mFileIndexes[fd];
+		sqe.flags |= IOSQE_FIXED_FILE;
+	}
+	for (size_t i = 0; opcode != IORING_OP_FSYNC && i < mBuffers.size(); ++i) {
+		char* pBase = static_cast<char*>(mBuffers[i].iov_base);
+		if (buffer >= pBase && buffer + size <= pBase + mBuffers[i].iov_len) {
+			sqe.opcode = opcode == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe.buf_index = static_cast<uint16_t>(i);
+			break;
+		}
+	}
+	queueSqe(sqe);
+	bool cancelled = false;
+	if (rToken.canBeCancelled()) {
+		Slot& rSlot = mSlots[slot];
+		rSlot.spCancel = std::make_shared<Cancel>(*this, userData, rToken, spTask);
+		rSlot.spCancel->self = rSlot.spCancel;
+		if (!rToken.subscribe(*rSlot.spCancel)) { // cancelled meanwhile
+			rSlot.spCancel->self.reset();
+			rSlot.spCancel.reset();
+			if (unqueue(userData)) {
+				rSlot.spTask.reset();
+				mFreeSlots.push_back(slot);
+				cancelled = true;
+			} else
+				queueCancel(userData);
+		}
+	}
+	lk.unlock();
+
+	if (cancelled)
+		resolve<T>(spTask, 0, ECANCELED);
+	else if (currentBatch != this)
+		submit();
+	return spTask;
+}
+
+void FileRing::queueSqe(io_uring_sqe const& rSqe) {
+	mQueue->entries.push_back(rSqe);
+	moveQueued();
+}
+
+void FileRing::moveQueued() {
+	std::deque<io_uring_sqe>& rEntries = mQueue->entries;
+	unsigned tail = *mSqTail; // only we write it (under the lock)
+	unsigned moved = 0;
+	while (!rEntries.empty() && mInFlight < mCqEntries && tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) != mEntries) { // neither the completion ring may overflow nor the submission ring fill up (that one is emptied by the submit() without the lock)
+		static_cast<io_uring_sqe*>(mSqes)[tail & *mSqMask] = rEntries.front();
+		mSqArray[tail & *mSqMask] = tail & *mSqMask;
+		rEntries.pop_front();
+		++tail;
+		++mInFlight;
+		++moved;
+	}
+	if (!moved)
+		return;
+	__atomic_store_n(mSqTail, tail, __ATOMIC_RELEASE); // a submit() may enter them right away (from any thread, without the lock), so they're complete by now
+	mUnsubmitted.fetch_add(moved);
+}
+
+bool FileRing::unqueue(uint64_t userData) {
+	std::deque<io_uring_sqe>& rEntries = mQueue->entries;
+	auto it = std::find_if(rEntries.begin(), rEntries.end(), [userData](io_uring_sqe const& rSqe) { return rSqe.user_data == userData; });
+	if (it == rEntries.end())
+		return false;
+	rEntries.erase(it);
+	return true;
+}
+
+void FileRing::queueCancel(uint64_t userData) {
+	io_uring_sqe sqe;
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.addr = userData;
+	sqe.user_data = cancelMarker;
+	queueSqe(sqe);
+}
+
+std::shared_ptr<Task<size_t>> FileRing::readFileAsync(int fd, void* buffer, size_t size, uint64_t offset, CancellationToken const& rToken) {
+	return start<size_t>(IORING_OP_READ, fd, static_cast<char*>(buffer), size, offset, 0, rToken);
+}
+
+std::shared_ptr<Task<size_t>> FileRing::writeFileAsync(int fd, void const* buffer, size_t size, uint64_t offset, CancellationToken const& rToken) {
+	return start<size_t>(IORING_OP_WRITE, fd, static_cast<char*>(const_cast<void*>(buffer)), size, offset, 0, rToken);
+}
+
+std::shared_ptr<Task<int>> FileRing::fsyncAsync(int fd, bool dataOnly, CancellationToken const& rToken) {
+	return start<int>(IORING_OP_FSYNC, fd, nullptr, 0, 0, dataOnly ? IORING_FSYNC_DATASYNC : 0, rToken);
+}
+
+void FileRing::registerBuffers(std::vector<iovec> const& buffers) {
+	if (!mBuffers.empty())
+		throw std::logic_error("The buffers have been registered with the ring already.");
+	if (mRingFd >= 0 && ioUringRegister(mRingFd, IORING_REGISTER_BUFFERS, buffers.data(), static_cast<unsigned>(buffers.size())))
+		throw std::system_error(errno, std::generic_category(), "Could not register the buffers"); // e.g. ENOMEM over the RLIMIT_MEMLOCK
+	if (mRingFd >= 0)
+		mBuffers = buffers;
+}
+
+void FileRing::registerFiles(std::vector<int> const& files) {
+	if (!mFileIndexes.empty())
+		throw std::logic_error("The files have been registered with the ring already.");
+	if (mRingFd < 0 || files.empty())
+		return;
+	if (ioUringRegister(mRingFd, IORING_REGISTER_FILES, files.data(), static_cast<unsigned>(files.size())))
+		throw std::system_error(errno, std::generic_category(), "Could not register the files");
+	mFileIndexes.assign(*std::max_element(files.begin(), files.end()) + 1, -1);
+	for (size_t i = 0; i < files.size(); ++i)
+		mFileIndexes[files[i]] = static_cast<int>(i);
+}
+
+bool FileRing::usesUring() const {
+	return !mFallback;
+}
+
+FileRing::Batch::Batch(FileRing& rRing) : mRing(rRing), mOuter(currentBatch) {
+	currentBatch = &rRing;
+}
+
+FileRing::Batch::~Batch() {
+	currentBatch = mOuter;
+	mRing.submit();
+}
+
+FileRing& FileRing::defaultRing() {
+	static FileRing* ring = new FileRing(); // leaked on purpose, like the default executor
+	return *ring;
+}
+
+void FileRing::submit() {
+	while (mUnsubmitted.load()) {
+		if (mSubmitting.exchange(true))
+			return; // whoever is submitting checks again once it's done and takes ours too
+		struct Guard { std::atomic<bool>& rSubmitting; ~Guard() { rSubmitting.store(false); } } guard{mSubmitting};
+		if (!enter(mUnsubmitted.exchange(0)))
+			return;
+		std::unique_lock<std::mutex> lk(mSqMtx);
+		moveQueued(); // the submission ring has room again
+	}
+}
+
+bool FileRing::enter(unsigned count) {
+	while (count) {
+		int submitted = ioUringEnter(mRingFd, count, 0, 0);
+		if (submitted < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) { // out of the kernel's memory for the requests (the completion ring can't overflow): it comes back as the operations complete
+				if (std::this_thread::get_id() == mCompletionThread.get_id()) { // which is up to us to reap, so the rest waits for that
+					mUnsubmitted.fetch_add(count);
+					mResubmit = true;
+					return false;
+				}
+				std::this_thread::yield(); // without the mSqMtx, the completion thread is reaping them
+				continue;
+			}
+			throw std::system_error(errno, std::generic_category(), "Could not submit to the io_uring");
+		}
+		count -= submitted;
+	}
+	return true;
+}
+
+void FileRing::complete() {
+	struct Completion {
+		void (*resolve)(std::shared_ptr<void> const&, long, int);
+		std::shared_ptr<void> spTask;
+		std::shared_ptr<Cancel> spCancel;
+		int result; // -errno on failure
+	};
+	std::vector<Completion> batch;
+	bool stopped = false;
+	io_uring_cqe const* pCqes = static_cast<io_uring_cqe const*>(mCqes);
+	while (true) {
+		unsigned head = *mCqHead; // only we write it
+		unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (stopped) {
+				std::unique_lock<std::mutex> lk(mSqMtx);
+				if (mFreeSlots.size() == mSlots.size()) // nothing in flight
+					return;
+			}
+			if (mResubmit) { // nothing to reap but what we've left unsubmitted
+				mResubmit = false;
+				std::this_thread::yield();
+				submit();
+				continue;
+			}
+			ioUringEnter(mRingFd, 0, 1, IORING_ENTER_GETEVENTS); // an error (EINTR) just takes us round
+			continue;
+		}
+		{
+			std::unique_lock<std::mutex> lk(mSqMtx);
+			mInFlight -= tail - head;
+			for (; head != tail; ++head) {
+				io_uring_cqe const& rCqe = pCqes[head & *mCqMask];
+				if (rCqe.user_data == stopMarker) {
+					stopped = true;
+					continue;
+				}
+				if (rCqe.user_data == cancelMarker) // whether it's found the operation or not, the operation itself tells
+					continue;
+				unsigned slot = static_cast<unsigned>(rCqe.user_data & 0xffffffff);
+				Slot& rSlot = mSlots[slot];
+				batch.push_back(Completion{rSlot.resolve, std::move(rSlot.spTask), std::move(rSlot.spCancel), rCqe.res});
+				mFreeSlots.push_back(slot);
+			}
+			__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE); // the kernel may reuse the entries
+			moveQueued(); // as many as have completed
+		}
+		currentBatch = this; // the coroutines resumed right here (without an executor) queue their next operations, which go with a single syscall after the whole batch
+		for (Completion& rCompletion : batch) { // an exception escaping this (an unrecoverable error) ends the process, as for a std::thread
+			if (rCompletion.spCancel)
+				rCompletion.spCancel->release();
+			rCompletion.resolve(rCompletion.spTask, rCompletion.result < 0 ? 0 : rCompletion.result, rCompletion.result < 0 ? -rCompletion.result : 0);
+		}
+		currentBatch = nullptr;
+		batch.clear();
+		submit();
+	}
+}
+}
@@ -0,0 +1,74 @@
+#include "frameallocator.h"
+#include <atomic>
+
+namespace aw_coroutines {
+namespace {
+class SlabAllocator: public FrameAllocator {
+public:
+	void* allocate(size_t size) override {
+		if (size > maxPooledSize)
+			return ::operator new(size);
+		FreeList& list = threadLists.lists[sizeClassOf(size)];
+		if (Block* pBlock = list.head) {
+			list.head = pBlock->next;
+			--list.count;
+			return pBlock;
+		}
+		return ::operator new((sizeClassOf(size) + 1) * sizeClass);
+	}
+
+	void deallocate(void* p, size_t size) noexcept override {
+		if (size > maxPooledSize) {
+			::operator delete(p);
+			return;
+		}
+		FreeList& list = threadLists.lists[sizeClassOf(size)];
+		if (list.count == maxPooledBlocks) {
+			::operator delete(p);
+			return;
+		}
+		Block* pBlock = static_cast<Block*>(p);
+		pBlock->next = list.head;
+		list.head = pBlock;
+		++list.count;
+	}
+private:
+	struct Block {
+		Block* next;
+	};
+	struct FreeList {
+		Block* head = nullptr;
+		size_t count = 0;
+	};
+	struct ThreadLists { // a block freed by another thread than the one that allocated it goes to the freeing thread's list (or back to the heap once that's full), so a producer/consumer pair moves blocks one way
+		~ThreadLists() {
+			for (FreeList& list : lists)
+				while (Block* pBlock = list.head) {
+					list.head = pBlock->next;
+					::operator delete(pBlock);
+				}
+		}
+		FreeList lists[maxPooledSize / sizeClass];
+	};
+
+	static size_t sizeClassOf(size_t size) {
+		return size ? (size - 1) / sizeClass : 0;
+	}
+
+	static thread_local ThreadLists threadLists;
+};
+
+thread_local SlabAllocator::ThreadLists SlabAllocator::threadLists;
+
+SlabAllocator slabAllocator;
+std::atomic<FrameAllocator*> defaultFrameAllocator{&slabAllocator};
+}
+
+FrameAllocator& FrameAllocator::defaultAllocator() {
+	return *defaultFrameAllocator.load(std::memory_order_acquire);
+}
+
+void FrameAllocator::setDefault(FrameAllocator* pAllocator) {
+	defaultFrameAllocator.store(pAllocator ? pAllocator : &slabAllocator, std::memory_order_release);
+}
+}
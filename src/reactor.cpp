@@ -0,0 +1,387 @@
+#include "reactor.h"
+#include <cerrno>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace aw_coroutines {
+namespace {
+uint64_t const wakeUp = ~uint64_t(0); // the epoll data of the loop's eventfd, any other is a descriptor
+size_t const maxEvents = 256; // taken by one epoll_wait()
+
+template <class T>
+void resolve(std::shared_ptr<void> const& spTask, long result, int error) {
+	Task<T>& rTask = *static_cast<Task<T>*>(spTask.get());
+	if (error)
+		rTask.setException(std::system_error(error, std::generic_category()));
+	else
+		rTask.setResult(static_cast<T>(result));
+}
+
+bool wouldBlock() {
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+}
+
+struct Reactor::Cancel: CancellationCallback { // registered with the token of a parked operation
+	Cancel(Reactor& rReactor, int fd, bool write, CancellationToken const& rToken, std::shared_ptr<void> const& spTask) : CancellationCallback(&cancelled), reactor(rReactor), fd(fd), write(write), token(rToken), wpTask(spTask) {}
+	Reactor& reactor;
+	int fd;
+	bool write;
+	CancellationToken token;
+	std::weak_ptr<void> wpTask; // the operation on the descriptor may be somebody else's by the time we're called
+	std::shared_ptr<Cancel> self; // while we're subscribed
+
+	void release() { // the operation is done
+		if (token.unsubscribe(*this)) // otherwise it's being called right now, finds the operation gone and lets go of itself
+			self.reset();
+	}
+	static void cancelled(CancellationCallback&);
+};
+
+struct Reactor::Completion { // an operation taken off its descriptor, resolved once the whole batch has been processed
+	void (*resolve)(std::shared_ptr<void> const&, long, int);
+	std::shared_ptr<void> spTask;
+	long result;
+	int error;
+	std::shared_ptr<Cancel> spCancel;
+
+	void run(int error) {
+		if (spCancel)
+			spCancel->release();
+		resolve(spTask, result, error);
+	}
+	void run() {
+		run(error);
+	}
+};
+
+struct Reactor::Operation { // parked on its descriptor until the descriptor is ready
+	bool (*attempt)(int, Operation&) = nullptr; // false if it would block, true once it's done (with the result or the error)
+	void (*resolve)(std::shared_ptr<void> const&, long, int) = nullptr;
+	std::shared_ptr<void> spTask; // nullptr if nothing is parked
+	char* buffer = nullptr;
+	size_t size = 0;
+	size_t done = 0; // written so far
+	long result = 0;
+	int error = 0;
+	bool socket = false; // written with the send() so a closed peer doesn't raise the SIGPIPE
+	std::shared_ptr<Cancel> spCancel; // if it's been given a token
+
+	Completion take() {
+		return Completion{resolve, std::move(spTask), result, error, std::move(spCancel)};
+	}
+
+	static bool read(int fd, Operation& rOperation) {
+		ssize_t count;
+		do
+			count = ::read(fd, rOperation.buffer, rOperation.size);
+		while (count < 0 && errno == EINTR);
+		return rOperation.finish(count);
+	}
+
+	static bool write(int fd, Operation& rOperation) {
+		while (rOperation.done < rOperation.size) {
+			char const* pData = rOperation.buffer + rOperation.done;
+			size_t left = rOperation.size - rOperation.done;
+			ssize_t count = rOperation.socket ? ::send(fd, pData, left, MSG_NOSIGNAL) : ::write(fd, pData, left);
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				return rOperation.finish(count);
+			}
+			rOperation.done += count;
+		}
+		return rOperation.finish(rOperation.done);
+	}
+
+	static bool accept(int fd, Operation& rOperation) {
+		int accepted;
+		do
+			accepted = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		while (accepted < 0 && (errno == EINTR || errno == ECONNABORTED)); // a connection reset while queued, there may be others
+		return rOperation.finish(accepted);
+	}
+
+	static bool connected(int fd, Operation& rOperation) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length))
+			error = errno;
+		if (error) {
+			rOperation.error = error;
+			return true;
+		}
+		sockaddr_storage peer;
+		length = sizeof(peer);
+		if (getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &length)) // no error but no peer either: still connecting (e.g. the readiness reported when the socket was added)
+			return errno == ENOTCONN ? false : rOperation.finish(-1);
+		return rOperation.finish(fd);
+	}
+
+	bool finish(long count) {
+		if (count >= 0)
+			result = count;
+		else if (wouldBlock())
+			return false;
+		else
+			error = errno;
+		return true;
+	}
+};
+
+struct Reactor::Descriptor {
+	std::mutex mtx; // an operation is tried and parked under it, so the loop can't take the readiness in between
+	Loop* loop = nullptr; // nullptr unless it's been added
+	bool socket = false;
+	Operation reader; // or the acceptor
+	Operation writer; // or the connector
+};
+
+struct Reactor::Loop {
+	int epoll = -1;
+	int wakeFd = -1; // an eventfd, written to stop the loop
+	std::thread thread;
+};
+
+Reactor::Reactor(size_t loops, Executor* pExecutor) : mLoops(new Loop[loops ? loops : 1]), mLoopCount(loops ? loops : 1), mExecutor(pExecutor) {
+	try {
+		for (size_t i = 0; i < mLoopCount; ++i) {
+			Loop& rLoop = mLoops[i];
+			if ((rLoop.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 || (rLoop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+				throw std::system_error(errno, std::generic_category(), "Could not create the reactor's loop");
+			epoll_event event{};
+			event.events = EPOLLIN;
+			event.data.u64 = wakeUp;
+			if (epoll_ctl(rLoop.epoll, EPOLL_CTL_ADD, rLoop.wakeFd, &event))
+				throw std::system_error(errno, std::generic_category(), "Could not create the reactor's loop");
+		}
+		for (size_t i = 0; i < mLoopCount; ++i)
+			mLoops[i].thread = std::thread(&Reactor::run, this, std::ref(mLoops[i]));
+	} catch (...) {
+		stop();
+		throw;
+	}
+}
+
+Reactor::~Reactor() {
+	stop();
+	// nobody will retry the operations still parked, they end here (the coroutines resumed right away may still start new ones, which end the same way)
+	for (auto& rChunk : mChunks) {
+		Descriptor* pChunk = rChunk.load(std::memory_order_acquire);
+		for (size_t i = 0; pChunk && i < chunkSize; ++i)
+			for (Operation* pOperation : {&pChunk[i].reader, &pChunk[i].writer}) {
+				std::unique_lock<std::mutex> lk(pChunk[i].mtx);
+				if (!pOperation->spTask)
+					continue;
+				Completion cancelled = pOperation->take();
+				lk.unlock();
+				cancelled.run(ECANCELED);
+			}
+	}
+	for (auto& rChunk : mChunks)
+		delete[] rChunk.load(std::memory_order_relaxed);
+}
+
+void Reactor::stop() noexcept {
+	mStopping.store(true);
+	for (size_t i = 0; i < mLoopCount; ++i) {
+		Loop& rLoop = mLoops[i];
+		if (rLoop.thread.joinable()) {
+			uint64_t one = 1;
+			if (::write(rLoop.wakeFd, &one, sizeof(one)) == sizeof(one))
+				rLoop.thread.join();
+			else
+				rLoop.thread.detach(); // can't happen with an eventfd (short of its counter overflowing)
+		}
+		if (rLoop.wakeFd >= 0)
+			close(rLoop.wakeFd);
+		if (rLoop.epoll >= 0)
+			close(rLoop.epoll);
+		rLoop.wakeFd = rLoop.epoll = -1;
+	}
+}
+
+Reactor::Descriptor& Reactor::descriptor(int fd) { // the chunk of the table is added on the first use
+	if (fd < 0 || static_cast<size_t>(fd) >= chunkSize * maxChunks)
+		throw std::out_of_range("The descriptor is out of the reactor's range.");
+	std::atomic<Descriptor*>& rChunk = mChunks[fd / chunkSize];
+	Descriptor* pChunk = rChunk.load(std::memory_order_acquire);
+	if (!pChunk) {
+		std::unique_lock<std::mutex> lk(mTableMtx);
+		pChunk = rChunk.load(std::memory_order_relaxed);
+		if (!pChunk) {
+			pChunk = new Descriptor[chunkSize];
+			rChunk.store(pChunk, std::memory_order_release);
+		}
+	}
+	return pChunk[fd % chunkSize];
+}
+
+void Reactor::add(int fd) {
+	Descriptor& rDescriptor = descriptor(fd);
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+		throw std::system_error(errno, std::generic_category(), "Could not make the descriptor non-blocking");
+	int type;
+	socklen_t length = sizeof(type);
+	std::unique_lock<std::mutex> lk(rDescriptor.mtx);
+	if (rDescriptor.loop)
+		throw std::logic_error("The descriptor has been added to the reactor already.");
+	Loop& rLoop = mLoops[mNextLoop.fetch_add(1, std::memory_order_relaxed) % mLoopCount];
+	epoll_event event{};
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // both directions once and for all, so parking an operation takes no syscall
+	event.data.u64 = fd;
+	if (epoll_ctl(rLoop.epoll, EPOLL_CTL_ADD, fd, &event))
+		throw std::system_error(errno, std::generic_category(), "Could not add the descriptor to the reactor"); // e.g. EPERM for a regular file
+	rDescriptor.socket = !getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length);
+	rDescriptor.loop = &rLoop;
+}
+
+void Reactor::remove(int fd) {
+	Descriptor& rDescriptor = descriptor(fd);
+	Completion cancelled[2];
+	size_t count = 0;
+	std::unique_lock<std::mutex> lk(rDescriptor.mtx);
+	if (!rDescriptor.loop)
+		return;
+	epoll_ctl(rDescriptor.loop->epoll, EPOLL_CTL_DEL, fd, nullptr); // fails only if the descriptor has been closed, which has dropped it from the epoll anyway
+	rDescriptor.loop = nullptr;
+	for (Operation* pOperation : {&rDescriptor.reader, &rDescriptor.writer})
+		if (pOperation->spTask)
+			cancelled[count++] = pOperation->take();
+	lk.unlock();
+	for (size_t i = 0; i < count; ++i)
+		cancelled[i].run(ECANCELED);
+}
+
+void Reactor::Cancel::cancelled(CancellationCallback& rCallback) {
+	Cancel& rCancel = static_cast<Cancel&>(rCallback);
+	std::shared_ptr<Cancel> spSelf = std::move(rCancel.self);
+	std::shared_ptr<void> spTask = rCancel.wpTask.lock();
+	if (!spTask)
+		return;
+	Descriptor& rDescriptor = rCancel.reactor.descriptor(rCancel.fd);
+	std::unique_lock<std::mutex> lk(rDescriptor.mtx);
+	Operation& rOperation = rCancel.write ? rDescriptor.writer : rDescriptor.reader;
+	if (rOperation.spTask != spTask) // done already
+		return;
+	Completion cancelled = rOperation.take();
+	lk.unlock();
+	cancelled.spCancel.reset(); // it's us, not subscribed any more
+	cancelled.run(ECANCELED);
+}
+
+template <class T>
+std::shared_ptr<Task<T>> Reactor::start(int fd, bool write, bool (*attempt)(int, Operation&), char* buffer, size_t size, CancellationToken const& rToken) {
+	Descriptor& rDescriptor = descriptor(fd);
+	std::shared_ptr<Task<T>> spTask = std::make_shared<Task<T>>();
+	spTask->setExecutor(mExecutor);
+	if (mStopping.load(std::memory_order_relaxed) || rToken.isCancelled()) {
+		resolve<T>(spTask, 0, ECANCELED);
+		return spTask;
+	}
+
+	std::unique_lock<std::mutex> lk(rDescriptor.mtx);
+	if (!rDescriptor.loop)
+		throw std::logic_error("The descriptor hasn't been added to the reactor.");
+	Operation& rOperation = write ? rDescriptor.writer : rDescriptor.reader;
+	if (rOperation.spTask)
+		throw std::logic_error("The descriptor has got an operation of this kind waiting already.");
+	rOperation.attempt = attempt;
+	rOperation.resolve = &resolve<T>;
+	rOperation.buffer = buffer;
+	rOperation.size = size;
+	rOperation.done = 0;
+	rOperation.result = 0;
+	rOperation.error = 0;
+	rOperation.socket = rDescriptor.socket;
+	if (!attempt(fd, rOperation)) {
+		rOperation.spTask = spTask; // parked until the loop sees the descriptor ready
+		if (!rToken.canBeCancelled())
+			return spTask;
+		rOperation.spCancel = std::make_shared<Cancel>(*this, fd, write, rToken, spTask);
+		rOperation.spCancel->self = rOperation.spCancel;
+		if (rToken.subscribe(*rOperation.spCancel)) // its callback takes the descriptor's mutex only once it's been called (without the token's)
+			return spTask;
+		Completion cancelled = rOperation.take(); // cancelled meanwhile
+		lk.unlock();
+		cancelled.spCancel->self.reset();
+		cancelled.spCancel.reset();
+		cancelled.run(ECANCELED);
+		return spTask;
+	}
+	long result = rOperation.result;
+	int error = rOperation.error;
+	lk.unlock();
+	resolve<T>(spTask, result, error); // completed right away, nobody awaits it yet
+	return spTask;
+}
+
+std::shared_ptr<Task<size_t>> Reactor::readAsync(int fd, void* buffer, size_t size, CancellationToken const& rToken) {
+	return start<size_t>(fd, false, &Operation::read, static_cast<char*>(buffer), size, rToken);
+}
+
+std::shared_ptr<Task<size_t>> Reactor::writeAsync(int fd, void const* buffer, size_t size, CancellationToken const& rToken) {
+	return start<size_t>(fd, true, &Operation::write, static_cast<char*>(const_cast<void*>(buffer)), size, rToken);
+}
+
+std::shared_ptr<Task<int>> Reactor::acceptAsync(int fd, CancellationToken const& rToken) {
+	return start<int>(fd, false, &Operation::accept, nullptr, 0, rToken);
+}
+
+std::shared_ptr<Task<int>> Reactor::connectAsync(int fd, sockaddr const* pAddress, socklen_t length, CancellationToken const& rToken) {
+	if (::connect(fd, pAddress, length) && errno != EINPROGRESS && errno != EINTR) { // interrupted it goes on asynchronously as well
+		std::shared_ptr<Task<int>> spTask = std::make_shared<Task<int>>();
+		spTask->setExecutor(mExecutor);
+		resolve<int>(spTask, 0, errno);
+		return spTask;
+	}
+	return start<int>(fd, true, &Operation::connected, nullptr, 0, rToken); // a cancelled connect leaves the socket connecting, close it
+}
+
+Reactor& Reactor::defaultReactor() {
+	static Reactor* reactor = new Reactor(); // leaked on purpose, like the default executor
+	return *reactor;
+}
+
+void Reactor::run(Loop& rLoop) {
+	epoll_event events[maxEvents];
+	std::vector<Completion> batch;
+	batch.reserve(2 * maxEvents); // never grows, an event completes two operations at most
+	bool stopping = false;
+	while (!stopping) {
+		int count = epoll_wait(rLoop.epoll, events, maxEvents, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			std::terminate(); // the epoll itself is broken
+		}
+		for (int i = 0; i < count; ++i) {
+			if (events[i].data.u64 == wakeUp) {
+				stopping = mStopping.load();
+				continue;
+			}
+			int fd = static_cast<int>(events[i].data.u64);
+			Descriptor& rDescriptor = mChunks[fd / chunkSize].load(std::memory_order_acquire)[fd % chunkSize];
+			uint32_t ready = events[i].events;
+			std::unique_lock<std::mutex> lk(rDescriptor.mtx);
+			// an event left over from before the descriptor was removed (and maybe added again) only makes us try in vain
+			if ((ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && rDescriptor.reader.spTask && rDescriptor.reader.attempt(fd, rDescriptor.reader))
+				batch.push_back(rDescriptor.reader.take());
+			if ((ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && rDescriptor.writer.spTask && rDescriptor.writer.attempt(fd, rDescriptor.writer))
+				batch.push_back(rDescriptor.writer.take());
+		}
+		for (Completion& rCompletion : batch) // an exception escaping this (an unrecoverable error) ends the process, as for a std::thread
+			rCompletion.run();
+		batch.clear();
+	}
+}
+}
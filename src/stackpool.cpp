@@ -0,0 +1,465 @@
+#include "stackpool.h"
+#include "common.h"
+#include "executor.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace aw_coroutines {
+namespace {
+size_t pageSize() {
+	static const size_t size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+thread_local int lastMapError = 0; // why the last stack this thread has tried to map couldn't be, for the throwNoStack()
+
+long mapCountLimit() { // the vm.max_map_count
+	long limit = 65530; // the kernel's default
+	if (FILE* pFile = std::fopen("/proc/sys/vm/max_map_count", "r")) {
+		if (std::fscanf(pFile, "%ld", &limit) != 1)
+			limit = 65530;
+		std::fclose(pFile);
+	}
+	return limit;
+}
+
+void* mapStack(size_t size) noexcept {
+	size_t guard = pageSize();
+	void* mapping = mmap(nullptr, size + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0); // pages are committed lazily, as they are touched
+	if (mapping == MAP_FAILED) {
+		lastMapError = errno;
+		return nullptr;
+	}
+	if (mprotect(mapping, guard, PROT_NONE)) { // the guard page below the stack (it grows downwards); it splits the mapping in two, which is what runs into the vm.max_map_count first
+		lastMapError = errno;
+		munmap(mapping, size + guard);
+		return nullptr;
+	}
+	Stats::count(StatsCounter::stacksMapped);
+	Stats::count(StatsCounter::stackBytesMapped, size + guard);
+	return static_cast<char*>(mapping) + guard;
+}
+
+void unmapStack(void* stack, size_t size) noexcept {
+	size_t guard = pageSize();
+	munmap(static_cast<char*>(stack) - guard, size + guard);
+	Stats::count(StatsCounter::stacksUnmapped);
+	Stats::count(StatsCounter::stackBytesUnmapped, size + guard);
+}
+
+struct GlobalStackList {
+	~GlobalStackList() {
+		for (auto& sized : stacks)
+			for (void* stack : sized.second)
+				unmapStack(stack, sized.first);
+	}
+	std::mutex mtx;
+	std::unordered_map<size_t, std::vector<void*>> stacks; // stacks by their size
+	size_t count = 0;
+	size_t capacity = 64;
+};
+
+GlobalStackList& globalList() {
+	static GlobalStackList list; // constructed on the first use so the thread caches can rely on it
+	return list;
+}
+
+std::atomic<size_t> cacheSize{4};
+std::atomic<size_t> defaultSize{8388608};
+
+void releaseToGlobalList(void* stack, size_t size) noexcept {
+	GlobalStackList& list = globalList();
+	std::unique_lock<std::mutex> lk(list.mtx);
+	if (list.count < list.capacity) {
+		try {
+			list.stacks[size].push_back(stack);
+			++list.count;
+			return;
+		} catch (const std::bad_alloc&) {} // no room for it, then just unmap it
+	}
+	lk.unlock();
+	unmapStack(stack, size);
+}
+
+struct ThreadStackCache {
+	~ThreadStackCache() { // the thread is going away (e.g. a thread that only resolved a task) so its stacks go to the global list
+		while (count) {
+			--count;
+			releaseToGlobalList(stacks[count].first, stacks[count].second);
+		}
+	}
+	std::pair<void*, size_t> stacks[StackPool::maxThreadCacheSize];
+	size_t count = 0;
+};
+
+thread_local ThreadStackCache threadCache;
+
+void* acquirePrivateStack(size_t size) noexcept {
+	for (size_t i = threadCache.count; i--; )
+		if (threadCache.stacks[i].second == size) {
+			void* stack = threadCache.stacks[i].first;
+			threadCache.stacks[i] = threadCache.stacks[--threadCache.count];
+			return stack;
+		}
+
+	GlobalStackList& list = globalList();
+	list.mtx.lock(); // there's nothing that could throw while the lock is held (thus no RAII)
+	auto sized = list.stacks.find(size);
+	if (sized != list.stacks.end() && !sized->second.empty()) {
+		void* stack = sized->second.back();
+		sized->second.pop_back();
+		--list.count;
+		list.mtx.unlock();
+		return stack;
+	}
+	list.mtx.unlock();
+	return mapStack(size);
+}
+
+void releasePrivateStack(void* stack, size_t size) noexcept {
+	if (threadCache.count < cacheSize.load(std::memory_order_relaxed)) {
+		threadCache.stacks[threadCache.count++] = {stack, size};
+		return;
+	}
+	releaseToGlobalList(stack, size);
+}
+
+struct Resumption {
+	void (*function)(void*);
+	std::shared_ptr<void> spArg;
+	Executor* pExecutor; // where the coroutine is to be resumed, nullptr for the trampoline
+};
+
+struct SharedStack {
+	void* stack = nullptr;
+	std::mutex mtx;
+	bool busy = false; // a coroutine is running on it
+	std::deque<Resumption> pending; // coroutines waiting for the stack to resume
+};
+
+struct SharedStacks {
+	std::mutex mtx;
+	std::atomic<bool> ready{false};
+	std::unique_ptr<SharedStack[]> stacks;
+	size_t count = std::max(2u, std::thread::hardware_concurrency());
+	size_t size = 0; // 0 means the default
+	std::atomic<size_t> next{0};
+};
+
+SharedStacks& sharedStacks() {
+	static SharedStacks& stacks = *new SharedStacks; // never destroyed: an executor's worker may still be finishing a coroutine on one while the statics go
+	return stacks;
+}
+
+bool createSharedStacks(SharedStacks& all) noexcept {
+	std::unique_lock<std::mutex> lk(all.mtx);
+	if (all.ready.load(std::memory_order_relaxed))
+		return true;
+	all.size = StackPool::stackSizeFor(all.size);
+	all.stacks.reset(new (std::nothrow) SharedStack[all.count]);
+	if (!all.stacks)
+		return false;
+	for (size_t i = 0; i < all.count; ++i)
+		if (!(all.stacks[i].stack = mapStack(all.size))) {
+			while (i--)
+				unmapStack(all.stacks[i].stack, all.size);
+			all.stacks.reset();
+			return false;
+		}
+	all.ready.store(true, std::memory_order_release);
+	return true;
+}
+
+void* acquireStackForLaunch(StackState& state) noexcept { // any shared stack nobody runs on and nobody waits for will do, if there's none the coroutine gets a stack of its own
+	SharedStacks& all = sharedStacks();
+	if (!all.ready.load(std::memory_order_acquire) && !createSharedStacks(all))
+		return nullptr;
+	size_t start = all.next.fetch_add(1, std::memory_order_relaxed);
+	for (size_t i = 0; i < all.count; ++i) {
+		SharedStack& shared = all.stacks[(start + i) % all.count];
+		std::unique_lock<std::mutex> lk(shared.mtx);
+		if (!shared.busy && shared.pending.empty()) {
+			shared.busy = true;
+			state.sharedStack = reinterpret_cast<size_t>(&shared);
+			state.stackSize = all.size;
+			return shared.stack;
+		}
+	}
+	state.stackSize = all.size;
+	return acquirePrivateStack(all.size);
+}
+
+std::atomic<bool> depthTracking{false};
+
+struct RoutineDepths {
+	size_t stackSize = 0;
+	size_t maxDepth = 0;
+	uint64_t coroutines = 0;
+	std::map<size_t, uint64_t> pages; // the coroutines by the number of pages they've touched
+};
+
+struct DepthRecords {
+	std::mutex mtx;
+	std::map<void (*)(), RoutineDepths> routines;
+};
+
+DepthRecords& depthRecords() {
+	static DepthRecords records;
+	return records;
+}
+
+size_t touchedDepth(char* stack, size_t size) noexcept { // the pages were dropped when the stack was acquired: the lowest one resident is as deep as it went, and in it the lowest word that isn't zero
+	size_t page = pageSize();
+	unsigned char resident[256];
+	for (size_t offset = 0; offset < size; ) {
+		size_t chunk = std::min(size - offset, sizeof(resident) * page);
+		if (mincore(stack + offset, chunk, resident))
+			return size; // can't tell, assume the worst
+		for (size_t i = 0; i < chunk / page; ++i) {
+			if (!(resident[i] & 1))
+				continue;
+			uint64_t const* pWord = reinterpret_cast<uint64_t const*>(stack + offset + i * page);
+			for (uint64_t const* pEnd = pWord + page / sizeof(uint64_t); pWord != pEnd; ++pWord)
+				if (*pWord)
+					return stack + size - reinterpret_cast<char const*>(pWord);
+			// a resident page of zeros: e.g. a part of a transparent huge page faulted in as a whole, keep going up
+		}
+		offset += chunk;
+	}
+	return 0;
+}
+
+void recordDepth(StackState& state) noexcept {
+	size_t depth = touchedDepth(reinterpret_cast<char*>(state.stackStoragePointer), state.stackSize);
+	size_t page = pageSize();
+	DepthRecords& records = depthRecords();
+	std::unique_lock<std::mutex> lk(records.mtx);
+	try {
+		RoutineDepths& routine = records.routines[state.routine];
+		++routine.pages[(depth + page - 1) / page];
+		++routine.coroutines;
+		routine.maxDepth = std::max(routine.maxDepth, depth);
+		routine.stackSize = std::max(routine.stackSize, state.stackSize);
+	} catch (const std::bad_alloc&) {} // this one goes unrecorded
+}
+
+size_t pagesPercentile(RoutineDepths const& routine, double fraction) {
+	uint64_t rank = static_cast<uint64_t>(fraction * routine.coroutines + 0.5);
+	uint64_t seen = 0;
+	for (auto& pages : routine.pages) {
+		seen += pages.second;
+		if (seen >= rank)
+			return pages.first * pageSize();
+	}
+	return 0;
+}
+
+template <class F>
+void removeFromGlobalList(F pred) { // unmaps the stacks for which the pred(count) says so, outside of the lock
+	GlobalStackList& list = globalList();
+	std::vector<std::pair<void*, size_t>> surplus;
+	std::unique_lock<std::mutex> lk(list.mtx);
+	for (auto& sized : list.stacks)
+		while (!sized.second.empty() && pred(list.count)) {
+			surplus.emplace_back(sized.second.back(), sized.first);
+			sized.second.pop_back();
+			--list.count;
+		}
+	lk.unlock();
+	for (auto& stack : surplus)
+		unmapStack(stack.first, stack.second);
+}
+}
+
+void StackPool::setDefaultStackSize(size_t size) {
+	defaultSize.store(stackSizeFor(size), std::memory_order_relaxed);
+}
+
+size_t StackPool::defaultStackSize() {
+	return defaultSize.load(std::memory_order_relaxed);
+}
+
+size_t StackPool::stackSizeFor(size_t size) {
+	if (size == sharedStack)
+		return size;
+	if (!size)
+		return defaultStackSize();
+	if (size < minStackSize)
+		size = minStackSize;
+	size_t page = pageSize();
+	return (size + page - 1) / page * page;
+}
+
+void StackPool::setCapacity(size_t stacks) {
+	{
+		GlobalStackList& list = globalList();
+		std::unique_lock<std::mutex> lk(list.mtx);
+		list.capacity = stacks;
+	}
+	removeFromGlobalList([stacks](size_t count){ return count > stacks; });
+}
+
+size_t StackPool::capacity() {
+	GlobalStackList& list = globalList();
+	std::unique_lock<std::mutex> lk(list.mtx);
+	return list.capacity;
+}
+
+void StackPool::setThreadCacheSize(size_t stacks) {
+	cacheSize.store(stacks < maxThreadCacheSize ? stacks : maxThreadCacheSize, std::memory_order_relaxed);
+}
+
+size_t StackPool::threadCacheSize() {
+	return cacheSize.load(std::memory_order_relaxed);
+}
+
+void StackPool::prewarm(size_t stacks, size_t size) {
+	size = stackSizeFor(size);
+	GlobalStackList& list = globalList();
+	std::unique_lock<std::mutex> lk(list.mtx);
+	std::vector<void*>& sized = list.stacks[size];
+	while (stacks-- && list.count < list.capacity) {
+		void* stack = mapStack(size);
+		if (!stack)
+			throw std::bad_alloc();
+		try {
+			sized.push_back(stack);
+		} catch (...) {
+			unmapStack(stack, size);
+			throw;
+		}
+		++list.count;
+	}
+}
+
+size_t StackPool::idleStacks() {
+	GlobalStackList& list = globalList();
+	std::unique_lock<std::mutex> lk(list.mtx);
+	return list.count;
+}
+
+void StackPool::trim() {
+	removeFromGlobalList([](size_t){ return true; });
+}
+
+void StackPool::setSharedStacks(size_t count, size_t size) {
+	SharedStacks& all = sharedStacks();
+	std::unique_lock<std::mutex> lk(all.mtx);
+	if (all.ready.load(std::memory_order_relaxed))
+		throw std::logic_error("The shared stacks are already in use.");
+	all.count = count ? count : 1;
+	all.size = size;
+}
+
+void StackPool::setDepthTracking(bool on) {
+	depthTracking.store(on, std::memory_order_relaxed);
+}
+
+std::vector<StackDepth> StackPool::depthReport() {
+	std::vector<StackDepth> report;
+	DepthRecords& records = depthRecords();
+	std::unique_lock<std::mutex> lk(records.mtx);
+	for (auto& routine : records.routines) {
+		Dl_info info;
+		char const* name = dladdr(reinterpret_cast<void*>(routine.first), &info) ? info.dli_sname : nullptr;
+		report.push_back({routine.first, name, routine.second.stackSize, routine.second.coroutines, routine.second.maxDepth, pagesPercentile(routine.second, 0.5), pagesPercentile(routine.second, 0.9), pagesPercentile(routine.second, 0.99)});
+	}
+	lk.unlock();
+	std::sort(report.begin(), report.end(), [](StackDepth const& a, StackDepth const& b) { return a.maxDepth > b.maxDepth; });
+	return report;
+}
+
+bool acquireSharedStack(StackState& state, void (*resume)(void*), std::shared_ptr<void> spArg, Executor* pExecutor) {
+	SharedStack& shared = *reinterpret_cast<SharedStack*>(state.sharedStack);
+	std::unique_lock<std::mutex> lk(shared.mtx);
+	if (shared.busy) {
+		shared.pending.push_back(Resumption{resume, std::move(spArg), pExecutor}); // if this throws the coroutine won't be resumed (the unrecoverable error)
+		return false;
+	}
+	shared.busy = true;
+	return true;
+}
+
+void saveSharedStack(StackState& state) {
+	size_t length = state.stackStoragePointer + state.stackSize - reinterpret_cast<size_t>(state.coroutineContext); // everything below the suspended context is dead
+	if (state.savedStackCapacity < length) {
+		void* saved = std::malloc(length);
+		if (!saved)
+			throw std::bad_alloc();
+		std::free(reinterpret_cast<void*>(state.savedStack));
+		state.savedStack = reinterpret_cast<size_t>(saved);
+		state.savedStackCapacity = length;
+	}
+	std::memcpy(reinterpret_cast<void*>(state.savedStack), state.coroutineContext, length);
+	state.savedStackLength = length;
+}
+
+void restoreSharedStack(StackState& state) noexcept {
+	std::memcpy(reinterpret_cast<void*>(state.stackStoragePointer + state.stackSize - state.savedStackLength), reinterpret_cast<void const*>(state.savedStack), state.savedStackLength);
+}
+
+void releaseSharedStack(StackState& state) {
+	SharedStack& shared = *reinterpret_cast<SharedStack*>(state.sharedStack);
+	std::unique_lock<std::mutex> lk(shared.mtx);
+	if (shared.pending.empty()) {
+		shared.busy = false;
+		return;
+	}
+	Resumption next = std::move(shared.pending.front()); // the stack stays busy, it's handed over to the next coroutine
+	shared.pending.pop_front();
+	lk.unlock();
+	// resumed where it would have been had the stack been free, not by whoever we are (a thread returning from the Caller::operator(), one in a wait()...)
+	if (next.pExecutor)
+		next.pExecutor->post(next.function, std::move(next.spArg));
+	else
+		runTrampolined(next.function, std::move(next.spArg)); // right after the current resumption if we're in one, so the native stack doesn't grow with every hand-over
+}
+
+bool acquireStack(StackState& state) noexcept {
+	void* stack = state.stackSize == StackPool::sharedStack ? acquireStackForLaunch(state) : acquirePrivateStack(state.stackSize);
+	state.stackStoragePointer = reinterpret_cast<size_t>(stack);
+	if (state.routine && !(stack && !state.sharedStack && depthTracking.load(std::memory_order_relaxed) && !madvise(stack, state.stackSize, MADV_DONTNEED))) // dropped pages read as zeros and aren't resident until touched
+		state.routine = nullptr; // not measured
+	return stack;
+}
+
+void releaseStack(StackState& state) noexcept {
+	if (state.sharedStack) {
+		std::free(reinterpret_cast<void*>(state.savedStack));
+		state.savedStack = state.savedStackCapacity = state.savedStackLength = 0;
+		return;
+	}
+	if (state.routine)
+		recordDepth(state);
+	releasePrivateStack(reinterpret_cast<void*>(state.stackStoragePointer), state.stackSize);
+}
+
+void throwNoStack(char const* what) {
+	int error = lastMapError ? lastMapError : ENOMEM;
+	std::string message = std::string("Could not get a stack for the ") + what;
+	if (error == ENOMEM) {
+		long limit = mapCountLimit();
+		message += ": most likely out of memory mappings. Every stack of its own is two of them (the stack and its guard page), so the vm.max_map_count of " + std::to_string(limit) + " allows fewer than " + std::to_string(limit / 2) + " such coroutines alive at once; raise it (sysctl -w vm.max_map_count=...) or launch them on the shared stacks";
+	}
+	throw std::system_error(error, std::generic_category(), message);
+}
+}
@@ -0,0 +1,132 @@
+#include "stats.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace aw_coroutines {
+namespace {
+size_t const counterCount = static_cast<size_t>(StatsCounter::count);
+size_t const latencyCount = static_cast<size_t>(StatsLatency::count);
+
+struct Shard { // written only by the thread owning it, the relaxed atomics are plain loads and stores on x86 and let the snapshot read them meanwhile
+	std::atomic<uint64_t> counters[counterCount];
+	std::atomic<uint64_t> histograms[latencyCount][LatencyHistogram::buckets];
+	std::atomic<uint64_t> sums[latencyCount];
+};
+
+void add(std::atomic<uint64_t>& rCounter, uint64_t value) { // no lock prefix, nobody else writes it
+	rCounter.store(rCounter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+struct Registry {
+	std::mutex mtx;
+	std::vector<std::unique_ptr<Shard>> shards;
+	uint64_t lastNanoseconds = Stats::now(); // of the previous snapshot
+	uint64_t lastLaunched = 0;
+};
+
+Registry& registry() {
+	static Registry* pRegistry = new Registry(); // leaked on purpose: the stacks are still unmapped while the static objects are being destroyed
+	return *pRegistry;
+}
+
+__attribute__((tls_model("initial-exec"))) thread_local Shard* pThreadShard = nullptr;
+
+Shard* threadShard() noexcept {
+	Shard*& pShard = pThreadShard;
+	if (!pShard) {
+		try {
+			std::unique_ptr<Shard> spShard(new Shard()); // value-initialized: all zeros
+			Registry& rRegistry = registry();
+			std::unique_lock<std::mutex> lk(rRegistry.mtx);
+			rRegistry.shards.push_back(std::move(spShard));
+			pShard = rRegistry.shards.back().get();
+		} catch (...) { // no memory for the shard, whatever this thread does isn't counted
+			return nullptr;
+		}
+	}
+	return pShard;
+}
+
+size_t bucketOf(uint64_t nanoseconds) {
+	if (!nanoseconds)
+		return 0;
+	size_t bucket = 63 - __builtin_clzll(nanoseconds);
+	return bucket < LatencyHistogram::buckets ? bucket : LatencyHistogram::buckets - 1;
+}
+
+void sumHistogram(LatencyHistogram& rHistogram, Shard const& rShard, size_t latency) {
+	for (size_t i = 0; i < LatencyHistogram::buckets; ++i) {
+		uint64_t count = rShard.histograms[latency][i].load(std::memory_order_relaxed);
+		rHistogram.counts[i] += count;
+		rHistogram.count += count;
+	}
+	rHistogram.sumNanoseconds += rShard.sums[latency].load(std::memory_order_relaxed);
+}
+
+uint64_t difference(uint64_t minuend, uint64_t subtrahend) { // the counters are read one by one, the later ones may have got ahead
+	return minuend > subtrahend ? minuend - subtrahend : 0;
+}
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+	uint64_t rank = static_cast<uint64_t>(fraction * count + 0.5);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets; ++i) {
+		seen += counts[i];
+		if (seen && seen >= rank)
+			return (uint64_t(1) << (i + 1)) - 1;
+	}
+	return 0;
+}
+
+StatsSnapshot Stats::snapshot() {
+	StatsSnapshot snapshot = StatsSnapshot(); // all zeros
+	uint64_t totals[counterCount] = {};
+	Registry& rRegistry = registry();
+	std::unique_lock<std::mutex> lk(rRegistry.mtx);
+	for (auto& spShard : rRegistry.shards) {
+		for (size_t i = 0; i < counterCount; ++i)
+			totals[i] += spShard->counters[i].load(std::memory_order_relaxed);
+		sumHistogram(snapshot.suspension, *spShard, static_cast<size_t>(StatsLatency::suspension));
+		sumHistogram(snapshot.waitBlocking, *spShard, static_cast<size_t>(StatsLatency::waitBlocking));
+	}
+	snapshot.nanoseconds = now();
+	snapshot.launched = totals[static_cast<size_t>(StatsCounter::launched)];
+	snapshot.finished = totals[static_cast<size_t>(StatsCounter::finished)];
+	snapshot.abandoned = totals[static_cast<size_t>(StatsCounter::abandoned)];
+	snapshot.live = difference(snapshot.launched, snapshot.finished + snapshot.abandoned);
+	snapshot.awaitsCompleted = totals[static_cast<size_t>(StatsCounter::awaitsCompleted)];
+	snapshot.awaitsSuspended = totals[static_cast<size_t>(StatsCounter::awaitsSuspended)];
+	snapshot.suspended = difference(snapshot.awaitsSuspended, snapshot.suspension.count + snapshot.abandoned); // every resumption is in the histogram
+	snapshot.stacksMapped = difference(totals[static_cast<size_t>(StatsCounter::stacksMapped)], totals[static_cast<size_t>(StatsCounter::stacksUnmapped)]);
+	snapshot.stackBytesMapped = difference(totals[static_cast<size_t>(StatsCounter::stackBytesMapped)], totals[static_cast<size_t>(StatsCounter::stackBytesUnmapped)]);
+	snapshot.waits = totals[static_cast<size_t>(StatsCounter::waits)];
+
+	uint64_t elapsed = snapshot.nanoseconds - rRegistry.lastNanoseconds;
+	snapshot.launchesPerSecond = elapsed ? difference(snapshot.launched, rRegistry.lastLaunched) * 1e9 / elapsed : 0;
+	rRegistry.lastNanoseconds = snapshot.nanoseconds;
+	rRegistry.lastLaunched = snapshot.launched;
+	return snapshot;
+}
+
+void Stats::count(StatsCounter counter, uint64_t value) noexcept {
+	if (Shard* pShard = threadShard())
+		add(pShard->counters[static_cast<size_t>(counter)], value);
+}
+
+void Stats::record(StatsLatency latency, uint64_t nanoseconds) noexcept {
+	if (Shard* pShard = threadShard()) {
+		add(pShard->histograms[static_cast<size_t>(latency)][bucketOf(nanoseconds)], 1);
+		add(pShard->sums[static_cast<size_t>(latency)], nanoseconds);
+	}
+}
+
+uint64_t Stats::now() noexcept {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+char const AW_STATS_SETTING = 0; // the marker of the setting the library is built with, see stats.h
+}
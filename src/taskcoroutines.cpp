@@ -1,70 +1,129 @@
 #include "common.h"
+#include "executor.h"
+#include "stats.h"
 #include <memory>
-#include <cstring>
+#include <exception>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace aw_coroutines {
 
-void copyNestedExceptionInfo(char* dst, const std::exception& exc, size_t size, bool first) {
-	if (!first) {
-		if (size >= 5) {
-			sprintf(dst, " <-- ");
-			size -= 5;
-			dst += 5;
-		} else {
-			dst[0] = '\0';
-			return;
-		}
+TaskAwaiterBase::TaskAwaiterBase() : mExecutor(&Executor::defaultExecutor()) {}
+
+TaskAwaiterBase::~TaskAwaiterBase() {
+	uintptr_t state = mState.load(std::memory_order_acquire);
+	if (state == completed)
+		return;
+	for (AwaiterCallbackBase* pCallback = reinterpret_cast<AwaiterCallbackBase*>(state); pCallback; ) { // never called, the task hasn't been resolved
+		AwaiterCallbackBase* pNext = pCallback->mNext;
+		if (pCallback->mAbandoned)
+			pCallback->mAbandoned(*pCallback);
+		pCallback = pNext;
 	}
+}
 
-	std::strncpy(dst, exc.what(), size-1);
+bool TaskAwaiterBase::isCompleted() const {
+	return mState.load(std::memory_order_acquire) == completed;
+}
 
-	size_t length = strlen(exc.what());
-	size_t nullPosition;
-	if (length < size - 1)
-		nullPosition = length;
-	else {
-		dst[size-1] = '\0';
-		return;
+bool TaskAwaiterBase::registerCallback(AwaiterCallbackBase* pCallback) {
+	uintptr_t state = mState.load(std::memory_order_acquire);
+	do {
+		if (state == completed)
+			return false;
+		pCallback->mNext = reinterpret_cast<AwaiterCallbackBase*>(state);
+	} while (!mState.compare_exchange_weak(state, reinterpret_cast<uintptr_t>(pCallback), std::memory_order_acq_rel, std::memory_order_acquire));
+	return true;
+}
+
+void TaskAwaiterBase::onCompleted(AwaiterCallbackBase& rCallback) {
+	if (!registerCallback(&rCallback))
+		rCallback.mCompleted(rCallback);
+}
+
+void TaskAwaiterBase::complete() {
+	uintptr_t state = mState.exchange(completed, std::memory_order_acq_rel); // the result (or the error) written before is published here
+	AwaiterCallbackBase* pFirst = nullptr;
+	for (AwaiterCallbackBase* pCallback = reinterpret_cast<AwaiterCallbackBase*>(state); pCallback; ) { // the list is pushed at its head, reversed it's in the order of registration
+		AwaiterCallbackBase* pNext = pCallback->mNext;
+		pCallback->mNext = pFirst;
+		pFirst = pCallback;
+		pCallback = pNext;
 	}
 
-	try {
-		std::rethrow_if_nested(exc);
-		dst[nullPosition] = '\0';
-	} catch (const std::exception& e) {
-		copyNestedExceptionInfo(dst+length, e, size - length, false);
+	std::exception_ptr firstException;
+	for (AwaiterCallbackBase* pCallback = pFirst; pCallback; ) {
+		AwaiterCallbackBase* pNext = pCallback->mNext; // the callback may be gone once called (e.g. the one of the wait())
+		try {
+			pCallback->mCompleted(*pCallback);
+		} catch (...) { // the rest of the callbacks still have to go (there may be a thread in the wait())
+			if (!firstException)
+				firstException = std::current_exception();
+		}
+		pCallback = pNext;
 	}
+	if (firstException)
+		std::rethrow_exception(firstException);
 }
 
-Coroutine_error::Coroutine_error(const std::string& what_arg) : runtime_error(what_arg) {}
-Coroutine_error::Coroutine_error(const char* what_arg) : runtime_error(what_arg) {}
+namespace {
+long futex(std::atomic<uint32_t>* pWord, int op, uint32_t value) {
+	return syscall(SYS_futex, reinterpret_cast<uint32_t*>(pWord), op, value, nullptr, nullptr, 0);
+}
 
-bool TaskAwaiterBase::isCompleted() {
-	mMtx.lock();
-	bool tmp = mCompleted;
-	mMtx.unlock();
-	return tmp;
+class WaitCallback: public AwaiterCallbackBase {
+public:
+	WaitCallback() : AwaiterCallbackBase(&signal) {}
+	std::atomic<uint32_t> mSignalled{0};
+private:
+	static void signal(AwaiterCallbackBase& rBase) {
+		WaitCallback& rCallback = static_cast<WaitCallback&>(rBase);
+		rCallback.mSignalled.store(1, std::memory_order_release);
+		futex(&rCallback.mSignalled, FUTEX_WAKE_PRIVATE, 1); // the waiting thread may be gone already, but the memory of its stack is still there
+	}
+};
 }
 
-void TaskAwaiterBase::onCompleted(std::unique_ptr<AwaiterCallbackBase> upCallback) {
-	mMtx.lock(); // there's nothing that could throw while the lock is held (thus no RAII)
-	if (mCompleted) {
-		mMtx.unlock();
-		(*upCallback)();
-	} else {
-		mOnCompletedCallback = std::move(upCallback);
-		mMtx.unlock();
+void TaskAwaiterBase::waitForCompletion() {
+	if (isCompleted())
+		return;
+	Stats::count(StatsCounter::waits); // only the wait() calls which have to wait are counted and timed
+	uint64_t start = Stats::now();
+	handOffTrampolined(); // we may be a coroutine resumed inline, what's queued behind us would run only after we've returned
+	for (int i = 0; i < 128; ++i) { // the task is often just about to be resolved, don't go to sleep right away
+		if (isCompleted())
+			break;
+		__builtin_ia32_pause();
 	}
+
+	WaitCallback callback;
+	if (!isCompleted() && registerCallback(&callback))
+		while (!callback.mSignalled.load(std::memory_order_acquire))
+			futex(&callback.mSignalled, FUTEX_WAIT_PRIVATE, 0); // returns right away if it's been signalled in the meantime
+	Stats::record(StatsLatency::waitBlocking, Stats::now() - start);
+}
+
+void TaskAwaiterBase::setExecutor(Executor* pExecutor) {
+	mExecutor = pExecutor;
+}
+
+Executor* TaskAwaiterBase::getExecutor() const {
+	return mExecutor;
 }
 
-const char* TaskAwaiterBase::hasErrors() const {
-	if (mError)
-		return mExcWhats;
-	else
+std::exception_ptr TaskAwaiterBase::getException() const {
+	if (!isCompleted()) // this makes the exception visible to us
 		return nullptr;
+	return mException;
+}
+
+void TaskAwaiterBase::rethrowIfFailed() const {
+	if (mException)
+		std::rethrow_exception(mException);
 }
 
-void TaskAwaiterBase::setError(const std::exception& ex) {
-	mError = true;
-	copyNestedExceptionInfo(mExcWhats, ex, sizeof(mExcWhats));
+void TaskAwaiterBase::setError(std::exception_ptr error) {
+	mException = std::move(error);
 }
 }
@@ -0,0 +1,264 @@
+#include "timers.h"
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "taskcoroutines.h"
+
+namespace aw_coroutines {
+struct TimerWheel::Sleep: Timer, CancellationCallback { // allocated together with its task
+	Sleep(TimerWheel& rWheel, CancellationToken const& rToken) : Timer(&fired), CancellationCallback(&cancelled), wheel(rWheel), token(rToken) {}
+	TimerWheel& wheel;
+	CancellationToken token;
+	Task<bool> task;
+	std::shared_ptr<Sleep> self; // keeps us (and the task) alive while we're scheduled
+	std::shared_ptr<Sleep> heldByToken; // while we're subscribed
+
+	static void fired(Timer& rTimer, bool elapsed) {
+		Sleep& rSleep = static_cast<Sleep&>(rTimer);
+		std::shared_ptr<Sleep> spSelf = std::move(rSleep.self); // whoever holds the task keeps us alive from now on
+		if (rSleep.token.unsubscribe(rSleep)) // otherwise it's being called right now, finds the timer gone and lets go of us itself
+			rSleep.heldByToken.reset();
+		rSleep.task.setResult(elapsed);
+	}
+	static void cancelled(CancellationCallback& rCallback) {
+		Sleep& rSleep = static_cast<Sleep&>(rCallback);
+		std::shared_ptr<Sleep> spSelf = std::move(rSleep.heldByToken);
+		if (!rSleep.wheel.cancel(rSleep)) // fired already
+			return;
+		rSleep.self.reset(); // spSelf still holds us
+		rSleep.task.setResult(false);
+	}
+};
+
+struct TimerWheel::Deadline: AwaiterCallbackBase, Timer { // the task and the timer race to resolve the result, whoever comes second only lets go of us
+	explicit Deadline(TimerWheel& rWheel) : AwaiterCallbackBase(&completed, &abandoned), Timer(&fired), wheel(rWheel) {}
+	TimerWheel& wheel;
+	Task<bool> task;
+	std::atomic<bool> decided{false};
+	std::shared_ptr<Deadline> heldByTask; // until the task is completed (or gone)
+	std::shared_ptr<Deadline> heldByTimer; // until the timer is fired or cancelled
+
+	static void completed(AwaiterCallbackBase& rBase) {
+		Deadline& rDeadline = static_cast<Deadline&>(rBase);
+		std::shared_ptr<Deadline> spSelf = std::move(rDeadline.heldByTask);
+		if (rDeadline.decided.exchange(true))
+			return;
+		if (rDeadline.wheel.cancel(rDeadline)) // otherwise it's being fired right now and lets go of us itself
+			rDeadline.heldByTimer.reset();
+		rDeadline.task.setResult(true);
+	}
+	static void abandoned(AwaiterCallbackBase& rBase) { // the task will never be completed, the timer decides
+		std::shared_ptr<Deadline> spSelf = std::move(static_cast<Deadline&>(rBase).heldByTask);
+	}
+	static void fired(Timer& rTimer, bool elapsed) {
+		Deadline& rDeadline = static_cast<Deadline&>(rTimer);
+		std::shared_ptr<Deadline> spSelf = std::move(rDeadline.heldByTimer);
+		if (elapsed && !rDeadline.decided.exchange(true))
+			rDeadline.task.setResult(false);
+	}
+};
+
+TimerWheel::TimerWheel(std::chrono::nanoseconds resolution, Executor* pExecutor) : mStart(std::chrono::steady_clock::now()), mResolution(resolution), mExecutor(pExecutor) {
+	if (resolution.count() <= 0)
+		throw std::invalid_argument("The resolution of the timer wheel has to be positive.");
+	if ((mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) // the clock of the steady_clock
+		throw std::system_error(errno, std::generic_category(), "Could not create the timer wheel's timerfd");
+	try {
+		mThread = std::thread(&TimerWheel::run, this);
+	} catch (...) {
+		close(mTimerFd);
+		throw;
+	}
+}
+
+TimerWheel::~TimerWheel() {
+	{
+		std::unique_lock<std::mutex> lk(mMtx);
+		mStopping = true;
+		arm(0); // long gone, goes off right away
+	}
+	mThread.join();
+	close(mTimerFd);
+	std::vector<Timer*> left;
+	for (auto& rLevel : mSlots)
+		for (Timer*& rSlot : rLevel)
+			for (Timer* pTimer = rSlot; pTimer; pTimer = pTimer->mNext) {
+				pTimer->mLink = nullptr;
+				left.push_back(pTimer);
+			}
+	mScheduled = 0;
+	for (Timer* pTimer : left)
+		pTimer->mFire(*pTimer, false);
+}
+
+uint64_t TimerWheel::tickOf(std::chrono::steady_clock::time_point when) const {
+	std::chrono::nanoseconds since = when - mStart;
+	if (since.count() <= 0)
+		return 0;
+	return (since.count() + mResolution.count() - 1) / mResolution.count();
+}
+
+void TimerWheel::schedule(Timer& rTimer, std::chrono::steady_clock::time_point when) {
+	uint64_t tick = tickOf(when);
+	std::unique_lock<std::mutex> lk(mMtx);
+	if (rTimer.mLink)
+		throw std::logic_error("The timer is scheduled already.");
+	if (!mScheduled) { // nothing in between to process, catch up with the clock (the thread doesn't tick while the wheel is empty)
+		uint64_t now = (std::chrono::steady_clock::now() - mStart) / mResolution;
+		if (now > mCurrent)
+			mCurrent = now;
+	}
+	rTimer.mTick = tick > mCurrent ? tick : mCurrent + 1;
+	uint64_t due = place(rTimer);
+	++mScheduled;
+	if (due < mArmed)
+		arm(due);
+}
+
+bool TimerWheel::cancel(Timer& rTimer) {
+	std::unique_lock<std::mutex> lk(mMtx);
+	if (!rTimer.mLink)
+		return false;
+	*rTimer.mLink = rTimer.mNext;
+	if (rTimer.mNext)
+		rTimer.mNext->mLink = rTimer.mLink;
+	rTimer.mLink = nullptr;
+	--mScheduled;
+	return true; // the timerfd may go off for nothing, that's cheaper than finding the next tick here
+}
+
+uint64_t TimerWheel::place(Timer& rTimer) {
+	uint64_t delta = rTimer.mTick - mCurrent;
+	unsigned level = 0;
+	while (level < levels - 1 && delta >= slots << (slotBits * level))
+		++level;
+	uint64_t tick = rTimer.mTick;
+	if (delta >= uint64_t(1) << (slotBits * levels)) // beyond the wheel: parked as far as it goes and placed again when it's cascaded
+		tick = mCurrent + (uint64_t(1) << (slotBits * levels)) - 1;
+	Timer*& rSlot = mSlots[level][(tick >> (slotBits * level)) & (slots - 1)];
+	rTimer.mNext = rSlot;
+	if (rSlot)
+		rSlot->mLink = &rTimer.mNext;
+	rSlot = &rTimer;
+	rTimer.mLink = &rSlot;
+	return level ? (tick >> (slotBits * level)) << (slotBits * level) : tick; // its own tick or the one its slot comes down at
+}
+
+uint64_t TimerWheel::nextDue() const {
+	uint64_t next = UINT64_MAX;
+	for (unsigned level = 0; level < levels; ++level) {
+		uint64_t base = mCurrent >> (slotBits * level);
+		for (uint64_t k = 1; k <= slots; ++k) // the current slot of a higher level comes down only after a whole turn (a timer beyond the wheel)
+			if (mSlots[level][(base + k) & (slots - 1)]) {
+				uint64_t due = (base + k) << (slotBits * level);
+				if (due < next)
+					next = due;
+				break;
+			}
+	}
+	return next;
+}
+
+void TimerWheel::advance() {
+	++mCurrent; // any tick, as long as nothing is due in between (the slots of the lower levels skipped are empty)
+	uint64_t index = mCurrent & (slots - 1);
+	for (unsigned level = 1; level < levels && !index; ++level) { // the lower level has wrapped around: the next slot of this one comes down
+		index = (mCurrent >> (slotBits * level)) & (slots - 1);
+		Timer* pTimer = mSlots[level][index];
+		mSlots[level][index] = nullptr;
+		while (pTimer) {
+			Timer* pNext = pTimer->mNext;
+			place(*pTimer);
+			pTimer = pNext;
+		}
+	}
+	Timer*& rSlot = mSlots[0][mCurrent & (slots - 1)];
+	for (Timer* pTimer = rSlot; pTimer; pTimer = pTimer->mNext) {
+		pTimer->mLink = nullptr;
+		mDue.push_back(pTimer);
+		--mScheduled;
+	}
+	rSlot = nullptr;
+}
+
+void TimerWheel::arm(uint64_t tick) {
+	mArmed = tick;
+	std::chrono::nanoseconds when = (mStart + std::chrono::nanoseconds(static_cast<int64_t>(tick) * mResolution.count())).time_since_epoch();
+	itimerspec spec{};
+	spec.it_value.tv_sec = when.count() / 1000000000;
+	spec.it_value.tv_nsec = when.count() % 1000000000;
+	if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+		spec.it_value.tv_nsec = 1; // zero would disarm it
+	timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, nullptr); // can't fail with a valid time
+}
+
+void TimerWheel::run() {
+	std::vector<Timer*> due;
+	while (true) {
+		uint64_t expirations;
+		if (read(mTimerFd, &expirations, sizeof(expirations)) < 0 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "Could not read the timer wheel's timerfd"); // can't happen
+		{
+			std::unique_lock<std::mutex> lk(mMtx);
+			if (mStopping)
+				return;
+			mArmed = UINT64_MAX; // it's one-shot
+			uint64_t now = (std::chrono::steady_clock::now() - mStart) / mResolution;
+			while (mScheduled) { // straight from one tick with anything to do to the next, the empty ones in between are skipped
+				uint64_t next = nextDue();
+				if (next > now) {
+					arm(next);
+					break;
+				}
+				mCurrent = next - 1;
+				advance();
+			}
+			if (!mScheduled && mCurrent < now)
+				mCurrent = now;
+			due.swap(mDue);
+		}
+		for (Timer* pTimer : due) // the timers of the ticks passed are fired together, in the order of the ticks
+			pTimer->mFire(*pTimer, true);
+		due.clear();
+	}
+}
+
+std::shared_ptr<Task<bool>> TimerWheel::sleepAsync(std::chrono::nanoseconds duration, CancellationToken const& rToken) {
+	std::shared_ptr<Sleep> spSleep = std::allocate_shared<Sleep>(FrameAllocatorAdaptor<Sleep>(FrameAllocator::defaultAllocator()), *this, rToken);
+	spSleep->task.setExecutor(mExecutor);
+	std::shared_ptr<Task<bool>> spTask(spSleep, &spSleep->task);
+	if (rToken.isCancelled() || duration.count() <= 0) {
+		spSleep->task.setResult(!rToken.isCancelled());
+		return spTask;
+	}
+	spSleep->self = spSleep;
+	spSleep->heldByToken = spSleep;
+	if (!rToken.subscribe(*spSleep))
+		spSleep->heldByToken.reset();
+	schedule(*spSleep, std::chrono::steady_clock::now() + duration);
+	if (rToken.isCancelled() && cancel(*spSleep)) { // cancelled before it was scheduled, the callback has found nothing to cancel
+		spSleep->self.reset();
+		spSleep->task.setResult(false);
+	}
+	return spTask;
+}
+
+std::shared_ptr<Task<bool>> TimerWheel::deadline(TaskAwaiterBase& rTask, std::chrono::steady_clock::time_point when) {
+	std::shared_ptr<Deadline> spDeadline = std::allocate_shared<Deadline>(FrameAllocatorAdaptor<Deadline>(FrameAllocator::defaultAllocator()), *this);
+	spDeadline->task.setExecutor(rTask.getExecutor());
+	std::shared_ptr<Task<bool>> spResult(spDeadline, &spDeadline->task);
+	spDeadline->heldByTimer = spDeadline;
+	schedule(*spDeadline, when);
+	spDeadline->heldByTask = spDeadline;
+	rTask.onCompleted(*spDeadline); // if the task is completed this goes right away
+	return spResult;
+}
+
+TimerWheel& TimerWheel::defaultWheel() {
+	static TimerWheel* wheel = new TimerWheel(); // leaked on purpose, like the default executor
+	return *wheel;
+}
+}
@@ -0,0 +1,159 @@
+#include "tracing.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+namespace aw_coroutines {
+namespace {
+struct Slot { // written only by the thread owning the buffer, the relaxed atomics are plain stores on x86 and let the export read them while it's recording
+	std::atomic<uint64_t> stampedEvent; // the TSC in the upper 56 bits, the event in the lowest byte
+	std::atomic<uintptr_t> object;
+};
+
+struct ThreadBuffer {
+	explicit ThreadBuffer(size_t size) : slots(new Slot[size]), mask(size - 1), threadId(syscall(SYS_gettid)) {}
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+	std::atomic<uint64_t> head{0}; // events recorded so far, the last mask + 1 of them are kept
+	long threadId;
+};
+
+uint64_t steadyNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Registry { // the buffers outlive their threads so whatever they have recorded can still be exported
+	std::mutex mtx;
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	size_t bufferSize = 65536;
+	uint64_t baseTsc = __rdtsc(); // events are stamped with the TSC (half the cost of the steady_clock) and converted to the steady_clock's time on the export
+	uint64_t baseNanoseconds = steadyNanoseconds();
+};
+
+Registry& registry() {
+	static Registry* pRegistry = new Registry(); // leaked on purpose: the threads may record while the static objects are being destroyed
+	return *pRegistry;
+}
+
+__attribute__((tls_model("initial-exec"))) thread_local ThreadBuffer* pThreadBuffer = nullptr; // not through the __tls_get_addr() on every event
+
+ThreadBuffer& threadBuffer() {
+	ThreadBuffer*& pBuffer = pThreadBuffer;
+	if (!pBuffer) {
+		Registry& rRegistry = registry();
+		std::unique_lock<std::mutex> lk(rRegistry.mtx);
+		rRegistry.buffers.push_back(std::make_shared<ThreadBuffer>(rRegistry.bufferSize));
+		pBuffer = rRegistry.buffers.back().get();
+	}
+	return *pBuffer;
+}
+
+struct Phase { // how an event shows on the timeline: the slices of the thread (B/E) and the async spans of the coroutine (b/e) between its suspension and its resumption
+	char const* name;
+	char sliceBegin;
+	char sliceEnd;
+	char const* asyncEnd;
+	char const* asyncBegin;
+};
+
+Phase const phases[] = {
+	{"coroutine", 'B', 0, nullptr, nullptr}, // launched
+	{"coroutine", 0, 'E', nullptr, "suspended"}, // suspended
+	{nullptr, 0, 0, "suspended", "queued"}, // woken
+	{"coroutine", 'B', 0, "queued", nullptr}, // resumed
+	{"coroutine", 0, 'E', nullptr, nullptr}, // finished
+	{"setResult", 0, 0, nullptr, nullptr}, // resolved
+	{"setException", 0, 0, nullptr, nullptr}, // failed
+	{"continueWith", 'B', 0, nullptr, nullptr}, // continuationStarted
+	{"continueWith", 0, 'E', nullptr, nullptr} // continuationFinished
+};
+
+void writeEvent(std::ostream& out, bool& first, char const* name, char const* phase, double ts, long tid, uintptr_t object, bool async) {
+	char line[256];
+	if (async)
+		std::snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"cat\":\"coroutine\",\"ph\":\"%s\",\"id\":\"0x%lx\",\"ts\":%.3f,\"pid\":1,\"tid\":%ld}", first ? "" : ",", name, phase, static_cast<unsigned long>(object), ts, tid);
+	else
+		std::snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":1,\"tid\":%ld,\"args\":{\"id\":\"0x%lx\"}}", first ? "" : ",", name, phase, *phase == 'i' ? "\"s\":\"t\"," : "", ts, tid, static_cast<unsigned long>(object));
+	out << line;
+	first = false;
+}
+}
+
+void Tracer::record(TraceEvent event, void const* object) noexcept {
+	ThreadBuffer* pBuffer;
+	try {
+		pBuffer = &threadBuffer();
+	} catch (...) { // no memory for the buffer, the event is lost
+		return;
+	}
+	uint64_t index = pBuffer->head.load(std::memory_order_relaxed);
+	Slot& rSlot = pBuffer->slots[index & pBuffer->mask];
+	rSlot.stampedEvent.store(__rdtsc() << 8 | static_cast<uint8_t>(event), std::memory_order_relaxed);
+	rSlot.object.store(reinterpret_cast<uintptr_t>(object), std::memory_order_relaxed);
+	pBuffer->head.store(index + 1, std::memory_order_release);
+}
+
+void Tracer::setBufferSize(size_t size) {
+	size_t rounded = 1;
+	while (rounded < size)
+		rounded <<= 1;
+	Registry& rRegistry = registry();
+	std::unique_lock<std::mutex> lk(rRegistry.mtx);
+	rRegistry.bufferSize = rounded;
+}
+
+void Tracer::exportChromeTrace(std::ostream& out) {
+	Registry& rRegistry = registry();
+	std::unique_lock<std::mutex> lk(rRegistry.mtx);
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers = rRegistry.buffers;
+	lk.unlock();
+	uint64_t tscNow = __rdtsc();
+	uint64_t nanosecondsNow = steadyNanoseconds();
+	double nanosecondsPerTick = tscNow > rRegistry.baseTsc ? static_cast<double>(nanosecondsNow - rRegistry.baseNanoseconds) / (tscNow - rRegistry.baseTsc) : 1.0;
+
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	for (auto& spBuffer : buffers) {
+		size_t size = spBuffer->mask + 1;
+		uint64_t head = spBuffer->head.load(std::memory_order_acquire);
+		uint64_t index = head > size ? head - size : 0;
+		for (; index < head; ++index) {
+			Slot& rSlot = spBuffer->slots[index & spBuffer->mask];
+			uint64_t stampedEvent = rSlot.stampedEvent.load(std::memory_order_relaxed);
+			uintptr_t object = rSlot.object.load(std::memory_order_relaxed);
+			if (spBuffer->head.load(std::memory_order_acquire) - index > size) // overwritten while we were reading it
+				continue;
+			uint64_t tsc = (stampedEvent >> 8) | (rRegistry.baseTsc & 0xff00000000000000); // the TSC wraps its 56 bits after years
+			Phase const& phase = phases[stampedEvent & 0xff];
+			double ts = (rRegistry.baseNanoseconds + (static_cast<double>(tsc) - rRegistry.baseTsc) * nanosecondsPerTick) / 1000.0; // microseconds
+			if (phase.asyncEnd)
+				writeEvent(out, first, phase.asyncEnd, "e", ts, spBuffer->threadId, object, true);
+			if (phase.sliceEnd)
+				writeEvent(out, first, phase.name, "E", ts, spBuffer->threadId, object, false);
+			if (phase.asyncBegin)
+				writeEvent(out, first, phase.asyncBegin, "b", ts, spBuffer->threadId, object, true);
+			if (phase.sliceBegin)
+				writeEvent(out, first, phase.name, "B", ts, spBuffer->threadId, object, false);
+			if (!phase.asyncEnd && !phase.sliceEnd && !phase.asyncBegin && !phase.sliceBegin)
+				writeEvent(out, first, phase.name, "i", ts, spBuffer->threadId, object, false);
+		}
+	}
+	out << "\n]}\n";
+}
+
+void Tracer::clear() {
+	Registry& rRegistry = registry();
+	std::unique_lock<std::mutex> lk(rRegistry.mtx);
+	for (auto& spBuffer : rRegistry.buffers)
+		spBuffer->head.store(0, std::memory_order_relaxed); // a thread recording meanwhile would write over it
+}
+
+char const AW_TRACING_SETTING = 0; // the marker of the setting the library is built with, see tracing.h
+}